@@ -0,0 +1,48 @@
+#include <cstdint>
+#include "../../kernel/error.hpp"
+
+extern "C" int64_t SyscallLogString(const char*);
+extern "C" void SyscallExit(int exit_code);
+extern "C" int64_t SyscallFutexWait(const uint32_t* addr, uint32_t expected, uint64_t timeout_ms);
+extern "C" int64_t SyscallFutexWake(const uint32_t* addr, uint64_t count);
+
+uint32_t futex_word;
+int failures;
+
+void Check(const char* name, int64_t actual, int64_t expected)
+{
+  SyscallLogString(name);
+  if (actual == expected)
+  {
+    SyscallLogString(": ok\n");
+  }
+  else
+  {
+    SyscallLogString(": NG\n");
+    ++failures;
+  }
+}
+
+extern "C" int main(int argc, char** argv)
+{
+  failures = 0;
+  futex_word = 1;
+
+  // アプリはスレッドを作れないので、別のタスクを起こす場合はターミナルの futexcheck で確かめる
+  // 値が食い違っていれば眠らずにすぐ戻る
+  Check("wait mismatch", SyscallFutexWait(&futex_word, 0, 0), -Error::kTryAgain);
+  // 誰も起こさないので時間切れで戻る
+  Check("wait timeout", SyscallFutexWait(&futex_word, 1, 10), -Error::kTimeout);
+  // 待っているタスクはいない
+  Check("wake nobody", SyscallFutexWake(&futex_word, 1), 0);
+
+  // カーネルの領域や境界の揃っていないアドレスは受け付けない
+  const auto kernel_addr = reinterpret_cast<const uint32_t*>(0x100000);
+  Check("wait kernel", SyscallFutexWait(kernel_addr, 0, 10), -Error::kBadAddress);
+  Check("wake kernel", SyscallFutexWake(kernel_addr, 1), -Error::kBadAddress);
+  const auto unaligned = reinterpret_cast<const uint32_t*>(
+      reinterpret_cast<uintptr_t>(&futex_word) + 1);
+  Check("wait unaligned", SyscallFutexWait(unaligned, 0, 10), -Error::kBadAddress);
+
+  SyscallExit(failures);
+}
@@ -0,0 +1,29 @@
+bits 64
+section .text
+
+global SyscallLogString
+SyscallLogString:
+    mov eax, 0x80000000
+    mov r10, rcx
+    syscall
+    ret
+
+global SyscallExit
+SyscallExit:
+    mov eax, 0x80000001
+    mov r10, rcx
+    syscall
+
+global SyscallFutexWait
+SyscallFutexWait:
+    mov eax, 0x80000002
+    mov r10, rcx
+    syscall
+    ret
+
+global SyscallFutexWake
+SyscallFutexWake:
+    mov eax, 0x80000003
+    mov r10, rcx
+    syscall
+    ret
\ No newline at end of file
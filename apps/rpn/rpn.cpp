@@ -24,6 +24,7 @@ void Push(long value)
 }
 
 extern "C" int64_t SyscallLogString(const char*);
+extern "C" void SyscallExit(int exit_code);
 
 extern "C" int main(int argc, char** argv)
 {
@@ -75,10 +76,8 @@ extern "C" int main(int argc, char** argv)
 
   if (stack_ptr < 0)
   {
-    return 0;
+    SyscallExit(0);
   }
   SyscallLogString("\nHello, this is RPN\n");
-  while (1)
-    ;
-  // return static_cast<int>(Pop());
+  SyscallExit(static_cast<int>(Pop()));
 }
\ No newline at end of file
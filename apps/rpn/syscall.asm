@@ -6,4 +6,10 @@ SyscallLogString:
     mov eax, 0x80000000
     mov r10, rcx
     syscall
-    ret
\ No newline at end of file
+    ret
+
+global SyscallExit
+SyscallExit:
+    mov eax, 0x80000001
+    mov r10, rcx
+    syscall
@@ -6,6 +6,8 @@ enum PixelFormat
 {
     kPixelRGBResv8BitPerColor,
     kPixelBGRResv8BitPerColor,
+    kPixelBGR8BitPerColor, // 1 画素 3 バイト。B, G, R の順
+    kPixelRGB565,          // 1 画素 2 バイト。上位から R 5 ビット, G 6 ビット, B 5 ビット
 };
 
 struct FrameBufferConfig
@@ -2,6 +2,7 @@
 #include "console.hpp"
 #include "logger.hpp"
 #include "asmfunc.h"
+#include "lock.hpp"
 #include <cstdlib>
 #include <cstring>
 
@@ -71,6 +72,7 @@ namespace acpi
   }
 
   const FADT* fadt;
+  const MADT* madt;
 
   void Initialize(const acpi::RSDP &rsdp)
   {
@@ -87,11 +89,13 @@ namespace acpi
     }
 
     fadt = nullptr;
+    madt = nullptr;
     for (int i = 0; i < xsdt.Count(); ++i) {
       const auto& entry = xsdt[i];
       if (entry.IsValid("FACP")) { // FADT のシグネチャは FACP
         fadt = reinterpret_cast<const FADT*>(&entry);
-        break;
+      } else if (entry.IsValid("APIC")) { // MADT のシグネチャは APIC
+        madt = reinterpret_cast<const MADT*>(&entry);
       }
     }
 
@@ -124,4 +128,20 @@ namespace acpi
     }
     while (IoIn32(fadt->pm_tmr_blk) < end);
   }
+
+  uint64_t PMTimerCount() {
+    // total と last は呼び出しの間でラップアラウンドを数えるのに使うので、複数の CPU から同時に触らせない
+    static SpinLock lock{"pm_timer"};
+    IRQSaveLockGuard guard{lock};
+    static uint64_t total = 0;
+    static uint32_t last = IoIn32(fadt->pm_tmr_blk);
+
+    const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+    const uint32_t mask = pm_timer_32 ? 0xffffffffu : 0x00ffffffu;
+    const uint32_t now = IoIn32(fadt->pm_tmr_blk);
+    // 差分をマスクすればラップアラウンドしていても正しい経過カウントになる
+    total += (now - last) & mask;
+    last = now;
+    return total;
+  }
 }
\ No newline at end of file
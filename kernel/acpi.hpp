@@ -51,10 +51,28 @@ namespace acpi
     char reserved3[276 - 116];
   } __attribute__((packed));
 
+  struct MADT {
+    DescriptionHeader header;
+
+    uint32_t local_apic_address;
+    uint32_t flags;
+    // 以降に種類と長さで始まる可変長のエントリが続く
+  } __attribute__((packed));
+
   extern const FADT* fadt;
+  // 見つからなければ nullptr
+  extern const MADT* madt;
   // 3.579545 MHz
   const uint32_t kPMTimerFreq = 3579545;
 
   void Initialize(const RSDP &rsdp);
   void WaitMilliseconds(unsigned long msec);
+
+  /** @brief PM タイマのカウント値を 64 ビットに拡張して返す。
+   *
+   * 初回呼び出し時を 0 とした単調増加カウント（kPMTimerFreq Hz）を返す。
+   * PM タイマのラップアラウンド（24 ビットの場合は約 4.7 秒）を検出するため、
+   * その周期より短い間隔で呼び出す必要がある。どの CPU からいつ呼んでもよい。
+   */
+  uint64_t PMTimerCount();
 }
\ No newline at end of file
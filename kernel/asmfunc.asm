@@ -178,15 +178,35 @@ GetCR3:
 ;    o64 iret
 
 global CallApp
-CallApp: ; void CallApp(int argc, char** argv, uint16_t cs, uint16_t ss, uint64_t rip, uint64_t rsp);
+CallApp: ; int CallApp(int argc, char** argv, uint16_t cs, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
+    mov rax, [rsp + 8] ; os_stack_ptr
+    push rbx
     push rbp
-    mov rbp, rsp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rax], rsp ; ExitApp で戻ってくるためのスタックポインタ
     push rcx  ; SS
     push r9   ; RSP
     push rdx  ; CS
     push r8   ; RIP
     o64 retf
-    ; アプリケーションが終了してもここには来ない
+    ; アプリケーションが終了すると ExitApp から CallApp の呼び出し元へ戻る
+
+global ExitApp
+ExitApp: ; void ExitApp(uint64_t rsp, int32_t ret_val);
+    mov rsp, rdi
+    mov eax, esi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+
+    ret ; CallApp の次の行に飛ぶ
 
 global LoadTR
 LoadTR: ; void LoadTR(uint16_t sel);
@@ -346,6 +366,35 @@ WriteMSR: ; void WriteMSR(uint32_t msr, uint64_t value);
     wrmsr
     ret
 
+global ReadMSR
+ReadMSR: ; uint64_t ReadMSR(uint32_t msr);
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global CPUID
+CPUID: ; void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+    push rbx     ; rbx は callee-saved
+    mov r8, rdx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r8], eax
+    mov [r8 + 4], ebx
+    mov [r8 + 8], ecx
+    mov [r8 + 12], edx
+    pop rbx
+    ret
+
+global ReadTSC
+ReadTSC: ; uint64_t ReadTSC();
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
 extern syscall_table
 global SyscallEntry
 SyscallEntry: ; void SyscallEntry(void);
@@ -367,4 +416,78 @@ SyscallEntry: ; void SyscallEntry(void);
     pop r11
     pop rcx
     pop rbp
-    o64 sysret
\ No newline at end of file
+    o64 sysret
+
+; AP の起動コード。1 MiB 未満のページへコピーして SIPI のベクタに指定する。
+; CS = ページ番号 << 8, IP = 0 のリアルモードで始まり、保護モードを経由せず
+; 直接ロングモードへ入って ApBootEntry を呼ぶ。
+; ApBootGDTR と ApBootJump のアドレス、ApBootCR3 以降のデータはコピー後に StartAPs が書き込む。
+bits 16
+global ApBootStart
+ApBootStart:
+    cli
+    mov ax, cs
+    mov ds, ax
+    lgdt [ApBootGDTR - ApBootStart]
+
+    mov eax, cr4
+    or eax, (1 << 5) | (1 << 9) | (1 << 10) ; PAE | OSFXSR | OSXMMEXCPT
+    mov cr4, eax
+    mov eax, [ApBootCR3 - ApBootStart]
+    mov cr3, eax
+    mov ecx, 0xc0000080 ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8      ; LME
+    wrmsr
+
+    mov eax, cr0
+    and eax, ~((1 << 2) | (1 << 29) | (1 << 30)) ; EM, NW, CD を落とす
+    or eax, (1 << 31) | (1 << 1) | 1             ; PG | MP | PE
+    mov cr0, eax
+global ApBootJump
+ApBootJump:
+    db 0x66, 0xea         ; jmp dword 8:ApBoot64
+    dd 0                  ; ApBoot64 の物理アドレス
+    dw 8
+
+bits 64
+global ApBoot64
+ApBoot64:
+    xor eax, eax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov rsp, [rel ApBootStack]
+    mov rdi, [rel ApBootCPU]
+    mov rax, [rel ApBootEntry]
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+global ApBootGDT
+ApBootGDT:
+    dq 0
+    dq 0x00af9a000000ffff ; 64 ビットのコードセグメント (セレクタ 8)
+global ApBootGDTR
+ApBootGDTR:
+    dw ApBootGDTR - ApBootGDT - 1
+    dd 0                  ; ApBootGDT の物理アドレス
+global ApBootCR3
+ApBootCR3:
+    dd 0
+align 8
+global ApBootStack
+ApBootStack:
+    dq 0
+global ApBootEntry
+ApBootEntry:
+    dq 0                  ; void (*)(uint64_t cpu)
+global ApBootCPU
+ApBootCPU:
+    dq 0
+global ApBootEnd
+ApBootEnd:
\ No newline at end of file
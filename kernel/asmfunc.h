@@ -18,7 +18,10 @@ extern "C"
     // I/O 読み込み
     uint8_t IoInb(uint8_t port);
 
-    void CallApp(int argc, char** argv, uint16_t cs, uint16_t ss, uint64_t rip, uint64_t rsp);
+    // アプリを実行し、ExitApp で終了したときの ret_val を返す
+    int CallApp(int argc, char** argv, uint16_t cs, uint16_t ss, uint64_t rip, uint64_t rsp,
+                uint64_t* os_stack_ptr);
+    [[noreturn]] void ExitApp(uint64_t rsp, int32_t ret_val);
 
     void LoadTR(uint16_t sel);
     void IntHandlerLAPICTimer();
@@ -27,5 +30,13 @@ extern "C"
     void RestoreContext(void* task_context);
 
     void WriteMSR(uint32_t msr, uint64_t value);
+    uint64_t ReadMSR(uint32_t msr);
+    // regs[0..3] に EAX, EBX, ECX, EDX を格納する
+    void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+    uint64_t ReadTSC();
     void SyscallEntry(void);
+
+    // AP の起動コード (ApBootStart から ApBootEnd まで) とその中のデータの位置
+    extern uint8_t ApBootStart[], ApBoot64[], ApBootGDT[], ApBootGDTR[], ApBootJump[],
+        ApBootCR3[], ApBootStack[], ApBootEntry[], ApBootCPU[], ApBootEnd[];
 }
\ No newline at end of file
@@ -1,16 +1,126 @@
 #include "clock.hpp"
+#include "acpi.hpp"
 #include "fonts.hpp"
 #include "asmfunc.h"
 #include <memory>
 #include "layer.hpp"
 #include "window.hpp"
 #include "frame_buffer.hpp"
+#include "console.hpp"
+#include "timer.hpp"
+#include "lock.hpp"
 
 std::shared_ptr<Window> clock_window;
 unsigned int clock_layer_id;
 const int clock_width = 80;
 
+namespace
+{
+  // アプリに公開するので、他のカーネルのデータと同じページに載らないよう 1 ページ占有する
+  struct alignas(4096)
+  {
+    ClockPage page;
+    uint8_t padding[4096 - sizeof(ClockPage)];
+  } clock_page_frame;
+
+  // TSC が invariant でないときの単調時刻の元（PM タイマのカウント）
+  uint64_t pm_clock_base;
+
+  // CMOS のインデックスとデータのポートは組で使うので、読み終えるまで他から触らせない
+  SpinLock cmos_lock{"cmos"};
+
+  uint8_t ReadCMOS(uint8_t reg)
+  {
+    IoOutb(0x70, reg);
+    return IoInb(0x71);
+  }
+
+  struct RTCTime
+  {
+    uint8_t second, minute, hour, day, month, year, status_b;
+  };
+
+  bool operator==(const RTCTime &lhs, const RTCTime &rhs)
+  {
+    return lhs.second == rhs.second && lhs.minute == rhs.minute && lhs.hour == rhs.hour &&
+           lhs.day == rhs.day && lhs.month == rhs.month && lhs.year == rhs.year;
+  }
+
+  RTCTime ReadRTCOnce()
+  {
+    // 更新中 (Status A の UIP ビット) は値が不定なので待つ
+    while (ReadCMOS(0x0A) & 0x80);
+    return {ReadCMOS(0x00), ReadCMOS(0x02), ReadCMOS(0x04),
+            ReadCMOS(0x07), ReadCMOS(0x08), ReadCMOS(0x09), ReadCMOS(0x0B)};
+  }
+
+  /** @brief RTC から UNIX 時刻（秒）を読む。起動時に一度だけ呼ぶ */
+  uint64_t ReadRTCUnixTime()
+  {
+    RTCTime t;
+    {
+      IRQSaveLockGuard guard{cmos_lock};
+      // 読んでいる途中で更新されていないか、2 回続けて同じ値になるまで読み直す
+      t = ReadRTCOnce();
+      while (true)
+      {
+        const RTCTime next = ReadRTCOnce();
+        if (next == t)
+        {
+          break;
+        }
+        t = next;
+      }
+    }
+
+    auto bcd = [](uint8_t v) { return (v & 0x0F) + (v / 16) * 10; };
+    int second = t.second, minute = t.minute, hour = t.hour;
+    int day = t.day, month = t.month, year = t.year;
+
+    // BCD モードの場合
+    if (!(t.status_b & 0x04))
+    {
+      second = bcd(second);
+      minute = bcd(minute);
+      hour = bcd(hour & 0x7F) | (hour & 0x80);
+      day = bcd(day);
+      month = bcd(month);
+      year = bcd(year);
+    }
+
+    // 12 時間モードの場合
+    if (!(t.status_b & 0x02) && (hour & 0x80))
+    {
+      hour = ((hour & 0x7F) + 12) % 24;
+    }
+    year += 2000;
+
+    // 1970-01-01 からの日数 (days from civil)
+    const int y = year - (month <= 2);
+    const int era = y / 400;
+    const int yoe = y - era * 400;
+    const int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    const int64_t days = static_cast<int64_t>(era) * 146097 + doe - 719468;
+
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+  }
+}
+
 void InitializeClock() {
+  auto &page = clock_page_frame.page;
+  page.tsc_freq = tsc_freq;
+  page.ns_mult = (1000000000ul << 32) / tsc_freq;
+  page.wall_base_ns = ReadRTCUnixTime() * 1000000000ul;
+  page.tsc_base = ReadTSC();
+  page.flags = tsc_invariant ? kClockPageTSCInvariant : 0;
+  if (!tsc_invariant)
+  {
+    pm_clock_base = acpi::PMTimerCount();
+  }
+  printk("Clock: TSC %lu Hz (%s), UNIX time %lu\n", page.tsc_freq,
+         tsc_invariant ? "invariant" : "PM timer fallback", page.wall_base_ns / 1000000000ul);
+
   auto frame_buffer_config = GetFrameBufferConfig();
   // 時計レイヤーを生成
   clock_window = std::make_shared<Window>(clock_width, 32, frame_buffer_config.pixel_format);
@@ -23,35 +133,30 @@ void InitializeClock() {
   DrawClock(*clock_writer);
 }
 
-void DrawClock(PixelWriter& writer) {
-  // RTC からクロック読み込み（ふつうは一度だけ読み込んで、その後は自前で計算する）
-  __asm__("cli");
-  IoOutb(0x70, 0x00);
-  uint8_t second = IoInb(0x71);
-  IoOutb(0x70, 0x02);
-  uint8_t minute = IoInb(0x71);
-  IoOutb(0x70, 0x04);
-  uint8_t hour = IoInb(0x71);
-  IoOutb(0x70, 0x0B);
-  uint8_t statusB = IoInb(0x71);
-  __asm__("sti");
-
-  // BCD モードの場合
-  if (!(statusB & 0x04))
-  {
-    second = (second & 0x0F) + ((second / 16) * 10);
-    minute = (minute & 0x0F) + ((minute / 16) * 10);
-    hour = ((hour & 0x0F) + (((hour & 0x70) / 16) * 10)) | (hour & 0x80);
+uint64_t NowNs() {
+  if (clock_page_frame.page.flags & kClockPageTSCInvariant) {
+    return ClockPageNowNs(clock_page_frame.page, ReadTSC());
   }
 
-  // 12 時間モードの場合
-  if (!(statusB & 0x02) && (hour & 0x80))
-  {
-    hour = ((hour & 0x7F) + 12) % 24;
-  }
+  // TSC の周波数が変わりうるので、精度は落ちるが一定の周波数の PM タイマで測る
+  const uint64_t count = acpi::PMTimerCount() - pm_clock_base;
+  return static_cast<uint64_t>(static_cast<unsigned __int128>(count) * 1000000000ul / acpi::kPMTimerFreq);
+}
 
+uint64_t WallClockNs() {
+  return clock_page_frame.page.wall_base_ns + NowNs();
+}
+
+const ClockPage& GetClockPage() {
+  return clock_page_frame.page;
+}
+
+void DrawClock(PixelWriter& writer) {
   // UTC -> JST
-  hour = (hour + 9) % 24;
+  const uint64_t sec = WallClockNs() / 1000000000ul + 9 * 3600;
+  const int second = sec % 60;
+  const int minute = sec / 60 % 60;
+  const int hour = sec / 3600 % 24;
 
   char str[128];
   sprintf(str, "%02d:%02d:%02d", hour, minute, second);
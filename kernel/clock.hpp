@@ -1,7 +1,16 @@
 #pragma once
+#include <cstdint>
 #include <memory>
+#include "clock_page.hpp"
 #include "window.hpp"
 
 extern std::shared_ptr<Window> clock_window;
 void InitializeClock();
-void DrawClock(PixelWriter &writer);
\ No newline at end of file
+void DrawClock(PixelWriter &writer);
+
+/** @brief 起動後の単調時刻 (ns)。invariant TSC から求め、TSC が invariant でなければ PM タイマから求める */
+uint64_t NowNs();
+/** @brief 現在の UNIX 時刻 (ns)。起動時に一度だけ RTC を読み、以降は NowNs() から求める */
+uint64_t WallClockNs();
+/** @brief アプリに読み出し専用で公開する時刻ページ */
+const ClockPage &GetClockPage();
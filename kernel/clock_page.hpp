@@ -0,0 +1,37 @@
+/**
+ * @file clock_page.hpp
+ *
+ * カーネルとアプリで共有する時刻ページの定義．
+ * アプリからもインクルードできるよう，他のカーネルのヘッダには依存しない．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// アプリのアドレス空間で時刻ページを読み出し専用で配置する仮想アドレス
+const uint64_t kClockPageAddr = 0xffff'ffff'ffff'd000;
+
+/** @brief 時刻ページ．起動時に一度だけ書き込まれ，以降は変化しない．
+ *
+ * 単調時刻は invariant TSC から求めるので，読み出しにシステムコールは要らない．
+ * flags に kClockPageTSCInvariant が無ければ TSC の周波数は一定でなく，求めた時刻はずれていく．
+ */
+struct ClockPage
+{
+  uint64_t tsc_freq;     // TSC の周波数 (Hz)
+  uint64_t tsc_base;     // 単調時刻 0 ns に対応する TSC の値
+  uint64_t ns_mult;      // ナノ秒 = (TSC の差分 * ns_mult) >> 32
+  uint64_t wall_base_ns; // 単調時刻 0 ns のときの UNIX 時刻 (ns)
+  uint64_t flags;        // kClockPage* の組み合わせ
+};
+
+// TSC が invariant で，ClockPageNowNs の値を信頼できる
+const uint64_t kClockPageTSCInvariant = 1;
+
+/** @brief TSC の値 tsc を単調時刻 (ns) に換算する */
+inline uint64_t ClockPageNowNs(const ClockPage &page, uint64_t tsc)
+{
+  const auto delta = static_cast<unsigned __int128>(tsc - page.tsc_base);
+  return static_cast<uint64_t>((delta * page.ns_mult) >> 32);
+}
@@ -4,6 +4,7 @@
 
 #include "fonts.hpp"
 #include "layer.hpp"
+#include "task.hpp"
 
 Console::Console(const PixelColor &fg_color, const PixelColor &bg_color)
     : window_{},
@@ -15,29 +16,45 @@ Console::Console(const PixelColor &fg_color, const PixelColor &bg_color)
 
 void Console::PutString(const char *s)
 {
-    while (*s)
     {
-        if (*s == '\n')
+        IRQSaveLockGuard guard{lock_};
+        while (*s)
         {
-            Newline();
-        }
-        else if (cursor_column_ < kColumns - 1)
-        {
-            WriteAscii(*writer_, 8 * cursor_column_, 16 * cursor_row_, *s, fg_color_);
-            buffer_[cursor_row_][cursor_column_] = *s;
-            ++cursor_column_;
+            if (*s == '\n')
+            {
+                Newline();
+            }
+            else if (cursor_column_ < kColumns - 1)
+            {
+                WriteAscii(*writer_, 8 * cursor_column_, 16 * cursor_row_, *s, fg_color_);
+                buffer_[cursor_row_][cursor_column_] = *s;
+                ++cursor_column_;
+            }
+            ++s;
         }
-        ++s;
     }
-    if (layer_manager)
+    if (!layer_manager)
+    {
+        return;
+    }
+
+    // 割り込みハンドラや描画中のタスクからも呼ばれるので待たない。
+    // 描画中なら、次の出力か描画のときに反映される
+    if (!task_manager)
+    {
+        layer_manager->Draw(layer_id_);
+    }
+    else if (layer_mutex.TryLock())
     {
         layer_manager->Draw(layer_id_);
+        layer_mutex.Unlock();
     }
 }
 
 void Console::Println(const char *s)
 {
     PutString(s);
+    IRQSaveLockGuard guard{lock_};
     Newline();
 }
 
@@ -58,13 +75,7 @@ void Console::Newline()
     }
     else
     {
-        for (int y = 0; y < 16 * kRows; ++y)
-        {
-            for (int x = 0; x < 8 * kColumns; ++x)
-            {
-                writer_->Write({x, y}, bg_color_);
-            }
-        }
+        FillRectangle(*writer_, {0, 0}, {8 * kColumns, 16 * kRows}, bg_color_);
         for (int row = 0; row < kRows - 1; ++row)
         {
             memcpy(buffer_[row], buffer_[row + 1], kColumns + 1);
@@ -2,6 +2,7 @@
 
 #include "window.hpp"
 #include "graphics.hpp"
+#include "lock.hpp"
 
 class Console
 {
@@ -19,6 +20,8 @@ public:
 private:
     void Newline();
 
+    // 複数の CPU や割り込みハンドラから書かれるので buffer_ とカーソルを保護する
+    SpinLock lock_{"console"};
     PixelWriter *writer_;
     std::shared_ptr<Window> window_;
     const PixelColor fg_color_, bg_color_;
@@ -32,6 +32,10 @@ public:
         kUnknownPixelFormat,
         kNoSuchTask,
         kInvalidFormat,
+        kNoSuchTimer,
+        kTryAgain,
+        kTimeout,
+        kBadAddress,
         kLastOfCode, // この列挙子は常に最後に配置する
     };
 
@@ -88,6 +92,10 @@ private:
         "kUnknownPixelFormat",
         "kNoSuchTask",
         "kInvalidFormat",
+        "kNoSuchTimer",
+        "kTryAgain",
+        "kTimeout",
+        "kBadAddress",
     };
 
     Code code_;
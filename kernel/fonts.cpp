@@ -27,16 +27,7 @@ void WriteAscii(PixelWriter &writer, int x, int y, char c, const PixelColor &col
         return;
     }
 
-    for (int dy = 0; dy < 16; ++dy)
-    {
-        for (int dx = 0; dx < 8; ++dx)
-        {
-            if ((font[dy] << dx) & 0x80u)
-            {
-                writer.Write({x + dx, y + dy}, color);
-            }
-        }
-    }
+    writer.WriteGlyph({x, y}, font, color);
 }
 
 void WriteString(PixelWriter &writer, Vector2D<int> pos, const char *s, const PixelColor &color)
@@ -2,6 +2,7 @@
 
 #include "graphics.hpp"
 
+const uint8_t *GetFont(char c);
 void WriteAscii(PixelWriter &writer, int x, int y, char c, const PixelColor &color);
 void WriteAscii(PixelWriter &writer, Vector2D<int> pos, char c, const PixelColor &color);
 void WriteString(PixelWriter &writer, Vector2D<int> pos, const char *s, const PixelColor &color);
\ No newline at end of file
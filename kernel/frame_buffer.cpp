@@ -1,18 +1,178 @@
 #include "frame_buffer.hpp"
+#include <algorithm>
 #include <cstring>
+#include <emmintrin.h>
+#include "asmfunc.h"
 
 namespace
 {
-    int BytesPerPixel(PixelFormat format)
+    // 1 行分の画素列をコピーする関数
+    using CopySpanFunc = void(uint8_t *dst, const uint8_t *src, size_t bytes);
+
+    void CopySpanSSE2(uint8_t *dst, const uint8_t *src, size_t bytes)
+    {
+        size_t i = 0;
+        for (; i + 64 <= bytes; i += 64)
+        {
+            const auto s = reinterpret_cast<const __m128i *>(src + i);
+            const auto d = reinterpret_cast<__m128i *>(dst + i);
+            const __m128i x0 = _mm_loadu_si128(s + 0), x1 = _mm_loadu_si128(s + 1);
+            const __m128i x2 = _mm_loadu_si128(s + 2), x3 = _mm_loadu_si128(s + 3);
+            _mm_storeu_si128(d + 0, x0);
+            _mm_storeu_si128(d + 1, x1);
+            _mm_storeu_si128(d + 2, x2);
+            _mm_storeu_si128(d + 3, x3);
+        }
+        for (; i + 16 <= bytes; i += 16)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                             _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+        }
+        // 1 画素 2, 3 バイトの形式では 4 バイト単位で終わらないことがある
+        memcpy(dst + i, src + i, bytes - i);
+    }
+
+    // rep movsb が速い CPU (ERMS) では、行の長さによらずこちらの方が速い
+    void CopySpanRepMovsb(uint8_t *dst, const uint8_t *src, size_t bytes)
+    {
+        __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(bytes) : : "memory");
+    }
+
+    // 本物のフレームバッファへはキャッシュを汚さない non-temporal ストアで書く。
+    // ストアの順序が緩いので、書き終えたら sfence が要る（FrameBuffer::Copy の最後で行う）
+    void CopySpanStreamSSE2(uint8_t *dst, const uint8_t *src, size_t bytes)
+    {
+        // movntdq は書き込み先が 16 バイト境界に無いといけないので、先頭は普通に書く
+        size_t i = std::min<size_t>(bytes, -reinterpret_cast<uintptr_t>(dst) & 15);
+        memcpy(dst, src, i);
+        for (; i + 64 <= bytes; i += 64)
+        {
+            const auto s = reinterpret_cast<const __m128i *>(src + i);
+            const auto d = reinterpret_cast<__m128i *>(dst + i);
+            const __m128i x0 = _mm_loadu_si128(s + 0), x1 = _mm_loadu_si128(s + 1);
+            const __m128i x2 = _mm_loadu_si128(s + 2), x3 = _mm_loadu_si128(s + 3);
+            _mm_stream_si128(d + 0, x0);
+            _mm_stream_si128(d + 1, x1);
+            _mm_stream_si128(d + 2, x2);
+            _mm_stream_si128(d + 3, x3);
+        }
+        for (; i + 16 <= bytes; i += 16)
+        {
+            _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i),
+                             _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+        }
+        memcpy(dst + i, src + i, bytes - i);
+    }
+
+    // バックバッファどうしのコピーに使う関数。最初の FrameBuffer::Initialize で CPUID を見て決める
+    CopySpanFunc *copy_span = nullptr;
+    const char *copy_span_name = "";
+
+    void SelectCopySpan()
+    {
+        if (copy_span)
+        {
+            return;
+        }
+
+        uint32_t regs[4]; // EAX, EBX, ECX, EDX
+        CPUID(0, 0, regs);
+        bool erms = false;
+        if (regs[0] >= 7)
+        {
+            CPUID(7, 0, regs);
+            erms = (regs[1] >> 9) & 1; // CPUID.07H:EBX[9] Enhanced REP MOVSB/STOSB
+        }
+        copy_span = erms ? CopySpanRepMovsb : CopySpanSSE2;
+        copy_span_name = erms ? "rep movsb" : "SSE2";
+    }
+
+    // x / 255 を四捨五入したもの (0 <= x <= 255 * 255)
+    inline uint32_t Div255(uint32_t x)
+    {
+        x += 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+    inline __m128i Div255Epi16(__m128i x)
+    {
+        x = _mm_add_epi16(x, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    }
+
+    // 16 ビットに広げた 2 画素分のチャネル s, d を、チャネルごとの不透明度 a で混ぜる
+    inline __m128i Blend2Pixels(__m128i s, __m128i d, __m128i a)
+    {
+        const __m128i inv = _mm_sub_epi16(_mm_set1_epi16(255), a);
+        return Div255Epi16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, inv)));
+    }
+
+    // 1 画素 4 バイトの形式を 4 画素ずつ混ぜ、処理した画素の数を返す。
+    // どのチャネルも同じ式で混ぜるので、チャネルの並びによらず使える
+    int BlendSpan32SSE2(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, uint8_t layer_alpha, int num_pixels)
     {
-        switch (format)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i la = _mm_set1_epi16(layer_alpha);
+        __m128i a01 = la, a23 = la;
+        int i = 0;
+        for (; i + 4 <= num_pixels; i += 4)
         {
-        case kPixelRGBResv8BitPerColor:
-            return 4;
-        case kPixelBGRResv8BitPerColor:
-            return 4;
+            if (alpha)
+            {
+                uint32_t a4;
+                memcpy(&a4, alpha + i, 4);
+                if (a4 == 0)
+                {
+                    continue; // 4 画素とも透明
+                }
+                if (a4 == 0xffffffffu && layer_alpha == 255)
+                {
+                    memcpy(dst + 4 * i, src + 4 * i, 16);
+                    continue;
+                }
+                __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a4), zero);
+                if (layer_alpha != 255)
+                {
+                    a = Div255Epi16(_mm_mullo_epi16(a, la));
+                }
+                // 画素ごとの不透明度を、その画素の 4 チャネルに並べる
+                const __m128i a0123 = _mm_unpacklo_epi16(a, a);
+                a01 = _mm_unpacklo_epi32(a0123, a0123);
+                a23 = _mm_unpackhi_epi32(a0123, a0123);
+            }
+            const auto s_p = reinterpret_cast<const __m128i *>(src + 4 * i);
+            const auto d_p = reinterpret_cast<__m128i *>(dst + 4 * i);
+            const __m128i s = _mm_loadu_si128(s_p), d = _mm_loadu_si128(d_p);
+            const __m128i lo = Blend2Pixels(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), a01);
+            const __m128i hi = Blend2Pixels(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), a23);
+            _mm_storeu_si128(d_p, _mm_packus_epi16(lo, hi));
+        }
+        return i;
+    }
+
+    // どの形式にも使える 1 画素ずつの実装。SSE2 版の残りの画素にも使う
+    template <class Traits>
+    void BlendSpanScalar(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, uint8_t layer_alpha, int num_pixels)
+    {
+        constexpr int kBytes = Traits::kBytesPerPixel;
+        for (int i = 0; i < num_pixels; ++i, dst += kBytes, src += kBytes)
+        {
+            const uint32_t a = alpha ? Div255(alpha[i] * layer_alpha) : layer_alpha;
+            if (a == 0)
+            {
+                continue;
+            }
+            const uint32_t sv = LoadPixel<kBytes>(src);
+            if (a == 255)
+            {
+                StorePixel<kBytes>(dst, sv);
+                continue;
+            }
+            const auto s = Traits::Unpack(sv);
+            const auto d = Traits::Unpack(LoadPixel<kBytes>(dst));
+            auto mix = [a](uint8_t sc, uint8_t dc) { return static_cast<uint8_t>(Div255(sc * a + dc * (255 - a))); };
+            StorePixel<kBytes>(dst, Traits::Pack({mix(s.r, d.r), mix(s.g, d.g), mix(s.b, d.b)}));
         }
-        return -1;
     }
 
     uint8_t *FrameAddrAt(Vector2D<int> pos, const FrameBufferConfig &config)
@@ -33,6 +193,7 @@ namespace
 
 Error FrameBuffer::Initialize(const FrameBufferConfig &config)
 {
+    SelectCopySpan();
     config_ = config;
 
     const auto bpp = BitsPerPixel(config_.pixel_format);
@@ -56,10 +217,12 @@ Error FrameBuffer::Initialize(const FrameBufferConfig &config)
     switch (config_.pixel_format)
     {
     case kPixelRGBResv8BitPerColor:
-        writer_ = std::make_unique<RGBResv8BitPerColorPixelWriter>(config_);
-        break;
     case kPixelBGRResv8BitPerColor:
-        writer_ = std::make_unique<BGRResv8BitPerColorPixelWriter>(config_);
+    case kPixelBGR8BitPerColor:
+    case kPixelRGB565:
+        VisitPixelFormat(config_.pixel_format, [this](auto traits) {
+            writer_ = std::make_unique<PixelFormatWriter<decltype(traits)::kFormat>>(config_);
+        });
         break;
     default:
         return MAKE_ERROR(Error::kUnknownPixelFormat);
@@ -87,14 +250,29 @@ Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer &src, const Rec
     const auto copy_area = dst_outline & src_outline & src_area_shifted;
     const auto src_start_pos = copy_area.pos - (dst_pos - src_area.pos);
 
+    if (copy_area.size.x <= 0 || copy_area.size.y <= 0)
+    {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
     uint8_t *dst_buf = FrameAddrAt(copy_area.pos, config_);
     const uint8_t *src_buf = FrameAddrAt(src_start_pos, src.config_);
+    const auto dst_bytes_per_scan_line = BytesPerScanLine(config_);
+    const auto src_bytes_per_scan_line = BytesPerScanLine(src.config_);
+    const size_t bytes_per_copy_line = bytesPerPixel * copy_area.size.x;
+    // 自分でメモリを持っていなければ本物のフレームバッファ
+    const bool to_screen = buffer_.empty();
+    CopySpanFunc *copy = to_screen ? CopySpanStreamSSE2 : copy_span;
 
     for (int y = 0; y < copy_area.size.y; ++y)
     {
-        memcpy(dst_buf, src_buf, bytesPerPixel * copy_area.size.x);
-        dst_buf += BytesPerScanLine(config_);
-        src_buf += BytesPerScanLine(src.config_);
+        copy(dst_buf, src_buf, bytes_per_copy_line);
+        dst_buf += dst_bytes_per_scan_line;
+        src_buf += src_bytes_per_scan_line;
+    }
+    if (to_screen)
+    {
+        _mm_sfence();
     }
 
     return MAKE_ERROR(Error::kSuccess);
@@ -104,14 +282,27 @@ void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int> &src)
 {
     const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
     const auto bytes_per_scan_line = BytesPerScanLine(config_);
+    const size_t bytes_per_copy_line = bytes_per_pixel * src.size.x;
 
-    if (dst_pos.y < src.pos.y)
+    if (dst_pos.y == src.pos.y)
+    {
+        // 同じ行の中で重なるので、行ごとに memmove で動かす
+        uint8_t *dst_buf = FrameAddrAt(dst_pos, config_);
+        const uint8_t *src_buf = FrameAddrAt(src.pos, config_);
+        for (int y = 0; y < src.size.y; ++y)
+        {
+            memmove(dst_buf, src_buf, bytes_per_copy_line);
+            dst_buf += bytes_per_scan_line;
+            src_buf += bytes_per_scan_line;
+        }
+    }
+    else if (dst_pos.y < src.pos.y)
     {
         uint8_t *dst_buf = FrameAddrAt(dst_pos, config_);
         const uint8_t *src_buf = FrameAddrAt(src.pos, config_);
         for (int y = 0; y < src.size.y; ++y)
         {
-            memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+            copy_span(dst_buf, src_buf, bytes_per_copy_line);
             dst_buf += bytes_per_scan_line;
             src_buf += bytes_per_scan_line;
         }
@@ -123,7 +314,7 @@ void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int> &src)
 
         for (int y = 0; y < src.size.y; ++y)
         {
-            memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+            copy_span(dst_buf, src_buf, bytes_per_copy_line);
             dst_buf -= bytes_per_scan_line;
             src_buf -= bytes_per_scan_line;
         }
@@ -135,6 +326,42 @@ FrameBufferConfig FrameBuffer::Config() const
     return config_;
 }
 
+const char *CopySpanName()
+{
+    return copy_span_name;
+}
+
+void CopySpan(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+    copy_span(dst, src, bytes);
+}
+
+void BlendSpan(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, uint8_t layer_alpha,
+               int num_pixels, PixelFormat format)
+{
+    if (layer_alpha == 0 || num_pixels <= 0)
+    {
+        return;
+    }
+    if (!alpha && layer_alpha == 255)
+    {
+        copy_span(dst, src, static_cast<size_t>(BytesPerPixel(format)) * num_pixels);
+        return;
+    }
+
+    VisitPixelFormat(format, [&](auto traits) {
+        using Traits = decltype(traits);
+        constexpr int kBytes = Traits::kBytesPerPixel;
+        int done = 0;
+        if constexpr (kBytes == 4)
+        {
+            done = BlendSpan32SSE2(dst, src, alpha, layer_alpha, num_pixels);
+        }
+        BlendSpanScalar<Traits>(dst + kBytes * done, src + kBytes * done, alpha ? alpha + done : nullptr,
+                                layer_alpha, num_pixels - done);
+    });
+}
+
 int BitsPerPixel(PixelFormat format)
 {
     switch (format)
@@ -143,6 +370,10 @@ int BitsPerPixel(PixelFormat format)
         return 32;
     case kPixelBGRResv8BitPerColor:
         return 32;
+    case kPixelBGR8BitPerColor:
+        return 24;
+    case kPixelRGB565:
+        return 16;
     }
 
     return -1;
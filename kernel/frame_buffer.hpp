@@ -24,4 +24,15 @@ private:
     std::unique_ptr<FrameBufferWriter> writer_{};
 };
 
-int BitsPerPixel(PixelFormat format);
\ No newline at end of file
+int BitsPerPixel(PixelFormat format);
+/** @brief バックバッファどうしのコピーに使っている実装の名前（CPUID で選ぶ） */
+const char *CopySpanName();
+/** @brief FrameBuffer::Copy と同じ実装で bytes バイト写す。書き込み先は本物のフレームバッファでないこと */
+void CopySpan(uint8_t *dst, const uint8_t *src, size_t bytes);
+/** @brief format の画素 num_pixels 個を、不透明度に応じて dst の画素と混ぜて dst へ書く。
+ *
+ * 画素 i の不透明度は alpha[i] * layer_alpha / 255（alpha が nullptr なら layer_alpha）。
+ * 不透明度 255 の画素はそのまま写し、0 の画素は書かない。
+ */
+void BlendSpan(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, uint8_t layer_alpha,
+               int num_pixels, PixelFormat format);
\ No newline at end of file
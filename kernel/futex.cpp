@@ -0,0 +1,102 @@
+#include "futex.hpp"
+
+#include <array>
+#include <optional>
+#include <limits>
+#include "lock.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace
+{
+  // アドレスのハッシュで待ち行列を分ける。同じ行列に並んだ別のアドレスは wait_key_ で区別する。
+  // アプリもカーネルと同じページテーブルで動くので、アドレスだけで待つ場所が決まる
+  const int kBucketBits = 6;
+
+  struct FutexBucket
+  {
+    SpinLock lock;
+    WaitQueue waiters;
+  };
+  std::array<FutexBucket, 1 << kBucketBits> buckets;
+
+  FutexBucket &BucketOf(uintptr_t key)
+  {
+    return buckets[((key >> 2) * 0x9e3779b97f4a7c15ull) >> (64 - kBucketBits)];
+  }
+}
+
+Error FutexWait(const volatile uint32_t *addr, uint32_t expected, unsigned long timeout)
+{
+  Task *current = &task_manager->CurrentTask();
+  const auto key = reinterpret_cast<uintptr_t>(addr);
+  auto &bucket = BucketOf(key);
+  {
+    IRQSaveLockGuard guard{bucket.lock};
+    if (*addr != expected)
+    {
+      return MAKE_ERROR(Error::kTryAgain);
+    }
+    bucket.waiters.Push(current, key);
+  }
+
+  std::optional<TimerHandle> timer;
+  if (timeout != std::numeric_limits<unsigned long>::max())
+  {
+    auto [handle, err] = timer_manager->AddTimer(Timer{timeout, kWakeupTimerValue, current->ID()});
+    if (err)
+    {
+      IRQSaveLockGuard guard{bucket.lock};
+      bucket.waiters.Remove(current);
+      return err;
+    }
+    timer = handle;
+  }
+
+  auto err = MAKE_ERROR(Error::kSuccess);
+  while (true)
+  {
+    // 並んでから Sleep するまでの FutexWake は wakeup_pending_ で拾える
+    current->Sleep();
+
+    IRQSaveLockGuard guard{bucket.lock};
+    if (!bucket.waiters.Contains(current))
+    {
+      break; // FutexWake が行列から取り出した
+    }
+    if (timer && timer_manager->CurrentTick() >= timeout)
+    {
+      bucket.waiters.Remove(current);
+      err = MAKE_ERROR(Error::kTimeout);
+      break;
+    }
+    // メッセージなど別の理由で起こされたので、もう一度待つ
+  }
+
+  if (timer)
+  {
+    timer_manager->CancelTimer(*timer);
+  }
+  return err;
+}
+
+int FutexWake(const volatile uint32_t *addr, int count)
+{
+  const auto key = reinterpret_cast<uintptr_t>(addr);
+  auto &bucket = BucketOf(key);
+  // 起こし終えるまでロックを持つ（起きたタスクがすぐに次の FutexWait で並べるよう、
+  // 取り出したタスクを別の行列に入れない）。ロックの順序は futex -> task_manager
+  IRQSaveLockGuard guard{bucket.lock};
+  int num_woken = 0;
+  while (num_woken < count)
+  {
+    Task *task = bucket.waiters.Pop(key);
+    if (!task)
+    {
+      break;
+    }
+    task->Wakeup();
+    ++num_woken;
+  }
+  return num_woken;
+}
\ No newline at end of file
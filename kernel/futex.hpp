@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include "error.hpp"
+
+/** @brief addr の値が expected のままなら、FutexWake で起こされるまでスリープする。
+ *
+ * 値の確認と待ち行列へ並ぶのは同じロックの中で行うので、確認の後に値を変えて
+ * FutexWake したタスクの通知を取りこぼさない。値が既に違えば kTryAgain、
+ * timeout (tick) を過ぎたら kTimeout を返す。timeout が unsigned long の最大値なら期限なし。
+ * 起きた後にも値を確認し直すこと（同じアドレスへの FutexWake が複数重なることがある）。
+ */
+Error FutexWait(const volatile uint32_t *addr, uint32_t expected, unsigned long timeout);
+/** @brief addr で待っているタスクを並んだ順に最大 count 個起こし、起こした数を返す */
+int FutexWake(const volatile uint32_t *addr, int count);
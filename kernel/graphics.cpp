@@ -1,35 +1,160 @@
 #include "graphics.hpp"
+#include <new>
+#include <emmintrin.h>
 #include "fonts.hpp"
 #include "console.hpp"
 
-void RGBResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor &c)
+void PixelWriter::FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor &c)
 {
-    auto p = PixelAt(pos.x, pos.y);
-    p[0] = c.r;
-    p[1] = c.g;
-    p[2] = c.b;
+    const auto area = ClipRect(pos, size, Width(), Height());
+    for (int dy = 0; dy < area.size.y; ++dy)
+    {
+        for (int dx = 0; dx < area.size.x; ++dx)
+        {
+            Write({area.pos.x + dx, area.pos.y + dy}, c);
+        }
+    }
 }
 
-void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor &c)
+void PixelWriter::WriteGlyph(Vector2D<int> pos, const uint8_t *glyph, const PixelColor &c)
 {
-    auto p = PixelAt(pos.x, pos.y);
-    p[0] = c.b;
-    p[1] = c.g;
-    p[2] = c.r;
+    for (int dy = 0; dy < 16; ++dy)
+    {
+        for (int dx = 0; dx < 8; ++dx)
+        {
+            if ((glyph[dy] << dx) & 0x80u)
+            {
+                Write({pos.x + dx, pos.y + dy}, c);
+            }
+        }
+    }
 }
 
-void FillRectangle(PixelWriter &writer, const Vector2D<int> &pos,
-                   const Vector2D<int> &size, const PixelColor &c)
+template <PixelFormat kFormat>
+void PixelFormatWriter<kFormat>::Write(Vector2D<int> pos, const PixelColor &c)
+{
+    StorePixel<Traits::kBytesPerPixel>(PixelAt(pos.x, pos.y), Traits::Pack(c));
+}
+
+template <PixelFormat kFormat>
+void PixelFormatWriter<kFormat>::FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor &c)
 {
-    for (int dy = 0; dy < size.y; ++dy)
+    const auto area = ClipRect(pos, size, Width(), Height());
+    const uint32_t value = Traits::Pack(c);
+    for (int dy = 0; dy < area.size.y; ++dy)
     {
-        for (int dx = 0; dx < size.x; ++dx)
+        uint8_t *p = PixelAt(area.pos.x, area.pos.y + dy);
+        if constexpr (Traits::kBytesPerPixel == 4)
         {
-            writer.Write({pos.x + dx, pos.y + dy}, c);
+            FillPixels32(reinterpret_cast<uint32_t *>(p), area.size.x, value);
+        }
+        else if constexpr (Traits::kBytesPerPixel == 2)
+        {
+            // 4 バイト境界から 2 画素ずつ詰めて書く
+            int n = area.size.x;
+            if (n > 0 && (reinterpret_cast<uintptr_t>(p) & 2) != 0)
+            {
+                StorePixel<2>(p, value);
+                p += 2;
+                --n;
+            }
+            FillPixels32(reinterpret_cast<uint32_t *>(p), n / 2, value | (value << 16));
+            if (n % 2 != 0)
+            {
+                StorePixel<2>(p + 2 * (n - 1), value);
+            }
+        }
+        else
+        {
+            for (int dx = 0; dx < area.size.x; ++dx, p += Traits::kBytesPerPixel)
+            {
+                StorePixel<Traits::kBytesPerPixel>(p, value);
+            }
         }
     }
 }
 
+template <PixelFormat kFormat>
+void PixelFormatWriter<kFormat>::WriteGlyph(Vector2D<int> pos, const uint8_t *glyph, const PixelColor &c)
+{
+    const auto area = ClipRect(pos, {8, 16}, Width(), Height());
+    const uint32_t value = Traits::Pack(c);
+    const int skip_x = area.pos.x - pos.x;
+    // 書き込み先からはみ出す列はマスクで落としておく
+    const unsigned int mask = (0xff00u >> area.size.x) & 0xffu;
+    for (int dy = 0; dy < area.size.y; ++dy)
+    {
+        unsigned int bits = ((glyph[area.pos.y - pos.y + dy] << skip_x) & 0xffu) & mask;
+        uint8_t *p = PixelAt(area.pos.x, area.pos.y + dy);
+        for (; bits != 0; bits = (bits << 1) & 0xffu, p += Traits::kBytesPerPixel)
+        {
+            if (bits & 0x80u)
+            {
+                StorePixel<Traits::kBytesPerPixel>(p, value);
+            }
+        }
+    }
+}
+
+template class PixelFormatWriter<kPixelRGBResv8BitPerColor>;
+template class PixelFormatWriter<kPixelBGRResv8BitPerColor>;
+template class PixelFormatWriter<kPixelBGR8BitPerColor>;
+template class PixelFormatWriter<kPixelRGB565>;
+
+FrameBufferWriter *NewFrameBufferWriter(void *buf, const FrameBufferConfig &config)
+{
+    return VisitPixelFormat(config.pixel_format, [buf, &config](auto traits) -> FrameBufferWriter * {
+        using Writer = PixelFormatWriter<decltype(traits)::kFormat>;
+        // pixel_writer_buf はどの形式でも同じ大きさで確保している
+        static_assert(sizeof(Writer) == sizeof(RGBResv8BitPerColorPixelWriter));
+        return new (buf) Writer{config};
+    });
+}
+
+void FillPixels32(uint32_t *dst, int count, uint32_t value)
+{
+    int i = 0;
+    // 16 バイト境界まで 1 画素ずつ書き、残りは 4 画素ずつまとめて書く
+    for (; i < count && (reinterpret_cast<uintptr_t>(dst + i) & 15) != 0; ++i)
+    {
+        dst[i] = value;
+    }
+    const __m128i v = _mm_set1_epi32(value);
+    for (; i + 16 <= count; i += 16)
+    {
+        const auto d = reinterpret_cast<__m128i *>(dst + i);
+        _mm_store_si128(d + 0, v);
+        _mm_store_si128(d + 1, v);
+        _mm_store_si128(d + 2, v);
+        _mm_store_si128(d + 3, v);
+    }
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_store_si128(reinterpret_cast<__m128i *>(dst + i), v);
+    }
+    for (; i < count; ++i)
+    {
+        dst[i] = value;
+    }
+}
+
+Rectangle<int> ClipRect(Vector2D<int> pos, Vector2D<int> size, int width, int height)
+{
+    const auto start = ElementMax(pos, {0, 0});
+    const auto end = ElementMin(pos + size, {width, height});
+    if (end.x <= start.x || end.y <= start.y)
+    {
+        return {start, {0, 0}};
+    }
+    return {start, end - start};
+}
+
+void FillRectangle(PixelWriter &writer, const Vector2D<int> &pos,
+                   const Vector2D<int> &size, const PixelColor &c)
+{
+    writer.FillRect(pos, size, c);
+}
+
 void DrawRectangle(PixelWriter &writer, const Vector2D<int> &pos,
                    const Vector2D<int> &size, const PixelColor &c)
 {
@@ -72,24 +197,14 @@ void DrawDesktop(PixelWriter &writer)
 
 Vector2D<int> screen_size;
 
-char pixel_writer_buf[sizeof(RGBResv8BitPerColorPixelWriter)];
+alignas(RGBResv8BitPerColorPixelWriter) char pixel_writer_buf[sizeof(RGBResv8BitPerColorPixelWriter)];
 PixelWriter *pixel_writer;
 FrameBufferConfig frame_buffer_config;
 
 void InitializeGraphics(const FrameBufferConfig &frame_buffer_config_ref)
 {
     frame_buffer_config = FrameBufferConfig{frame_buffer_config_ref};
-    switch (frame_buffer_config.pixel_format)
-    {
-    case kPixelRGBResv8BitPerColor:
-        pixel_writer = new (pixel_writer_buf)
-            RGBResv8BitPerColorPixelWriter{frame_buffer_config};
-        break;
-    case kPixelBGRResv8BitPerColor:
-        pixel_writer = new (pixel_writer_buf)
-            BGRResv8BitPerColorPixelWriter{frame_buffer_config};
-        break;
-    }
+    pixel_writer = NewFrameBufferWriter(pixel_writer_buf, frame_buffer_config);
 
     screen_size.x = frame_buffer_config.horizontal_resolution;
     screen_size.y = frame_buffer_config.vertical_resolution;
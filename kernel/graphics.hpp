@@ -80,6 +80,139 @@ inline bool operator!=(const PixelColor &lhs, const PixelColor &rhs)
     return !(lhs == rhs);
 }
 
+/** @brief 画素の形式ごとの 1 画素のバイト数と、色との変換。
+ *
+ * Pack は画素をメモリ上の並び順のまま（リトルエンディアンで）整数に詰める。
+ * 描画の基本操作はこれを引数にしたテンプレートで書き、形式の分岐は操作ごとに 1 回だけ行う。
+ */
+template <PixelFormat kFormat>
+struct PixelTraits;
+
+template <>
+struct PixelTraits<kPixelRGBResv8BitPerColor>
+{
+    static constexpr PixelFormat kFormat = kPixelRGBResv8BitPerColor;
+    static constexpr int kBytesPerPixel = 4;
+    static constexpr uint32_t Pack(const PixelColor &c) { return c.r | (c.g << 8) | (c.b << 16); }
+    static constexpr PixelColor Unpack(uint32_t v)
+    {
+        return {static_cast<uint8_t>(v), static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v >> 16)};
+    }
+};
+
+template <>
+struct PixelTraits<kPixelBGRResv8BitPerColor>
+{
+    static constexpr PixelFormat kFormat = kPixelBGRResv8BitPerColor;
+    static constexpr int kBytesPerPixel = 4;
+    static constexpr uint32_t Pack(const PixelColor &c) { return c.b | (c.g << 8) | (c.r << 16); }
+    static constexpr PixelColor Unpack(uint32_t v)
+    {
+        return {static_cast<uint8_t>(v >> 16), static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v)};
+    }
+};
+
+template <>
+struct PixelTraits<kPixelBGR8BitPerColor>
+{
+    static constexpr PixelFormat kFormat = kPixelBGR8BitPerColor;
+    static constexpr int kBytesPerPixel = 3;
+    static constexpr uint32_t Pack(const PixelColor &c) { return c.b | (c.g << 8) | (c.r << 16); }
+    static constexpr PixelColor Unpack(uint32_t v)
+    {
+        return {static_cast<uint8_t>(v >> 16), static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v)};
+    }
+};
+
+template <>
+struct PixelTraits<kPixelRGB565>
+{
+    static constexpr PixelFormat kFormat = kPixelRGB565;
+    static constexpr int kBytesPerPixel = 2;
+    static constexpr uint32_t Pack(const PixelColor &c)
+    {
+        return ((c.r >> 3) << 11) | ((c.g >> 2) << 5) | (c.b >> 3);
+    }
+    static constexpr PixelColor Unpack(uint32_t v)
+    {
+        // 下位ビットを上位ビットで埋めて 0xff まで届くようにする
+        const uint8_t r = (v >> 11) & 0x1f, g = (v >> 5) & 0x3f, b = v & 0x1f;
+        return {static_cast<uint8_t>((r << 3) | (r >> 2)),
+                static_cast<uint8_t>((g << 2) | (g >> 4)),
+                static_cast<uint8_t>((b << 3) | (b >> 2))};
+    }
+};
+
+/** @brief format に対応する PixelTraits を引数にして f を呼ぶ。知らない形式なら BGR として扱うので、
+ *         外から来た形式は先に確かめておくこと（FrameBuffer::Initialize は kUnknownPixelFormat を返す） */
+template <class Func>
+decltype(auto) VisitPixelFormat(PixelFormat format, Func &&f)
+{
+    switch (format)
+    {
+    case kPixelRGBResv8BitPerColor:
+        return f(PixelTraits<kPixelRGBResv8BitPerColor>{});
+    case kPixelBGR8BitPerColor:
+        return f(PixelTraits<kPixelBGR8BitPerColor>{});
+    case kPixelRGB565:
+        return f(PixelTraits<kPixelRGB565>{});
+    default:
+        return f(PixelTraits<kPixelBGRResv8BitPerColor>{});
+    }
+}
+
+/** @brief メモリ上の 1 画素を Pack と同じ並びの整数として読み書きする */
+template <int kBytesPerPixel>
+inline uint32_t LoadPixel(const uint8_t *p)
+{
+    if constexpr (kBytesPerPixel == 4)
+    {
+        return *reinterpret_cast<const uint32_t *>(p);
+    }
+    else if constexpr (kBytesPerPixel == 2)
+    {
+        return *reinterpret_cast<const uint16_t *>(p);
+    }
+    else
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16);
+    }
+}
+
+template <int kBytesPerPixel>
+inline void StorePixel(uint8_t *p, uint32_t v)
+{
+    if constexpr (kBytesPerPixel == 4)
+    {
+        *reinterpret_cast<uint32_t *>(p) = v;
+    }
+    else if constexpr (kBytesPerPixel == 2)
+    {
+        *reinterpret_cast<uint16_t *>(p) = v;
+    }
+    else
+    {
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+    }
+}
+
+inline uint32_t PackPixel(PixelFormat format, const PixelColor &c)
+{
+    return VisitPixelFormat(format, [&c](auto traits) { return decltype(traits)::Pack(c); });
+}
+
+inline PixelColor UnpackPixel(PixelFormat format, uint32_t value)
+{
+    return VisitPixelFormat(format, [value](auto traits) { return decltype(traits)::Unpack(value); });
+}
+
+inline int BytesPerPixel(PixelFormat format)
+{
+    return VisitPixelFormat(format, [](auto traits) { return decltype(traits)::kBytesPerPixel; });
+}
+
 const PixelColor kDesktopBGColor{58, 110, 165};
 const PixelColor kDesktopFGColor{255, 255, 255};
 
@@ -88,6 +221,17 @@ class PixelWriter
 public:
     virtual ~PixelWriter() = default;
     virtual void Write(Vector2D<int> pos, const PixelColor &c) = 0;
+    /** @brief 矩形を塗りつぶす。書き込み先の外にはみ出した部分は書かない。
+     *
+     * 既定の実装は Write を画素ごとに呼ぶ。画素を直接持つ書き込み先は行単位でまとめて書く。
+     */
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor &c);
+    void FillSpan(Vector2D<int> pos, int length, const PixelColor &c)
+    {
+        FillRect(pos, {length, 1}, c);
+    }
+    /** @brief 8x16 の 1 ビットのグリフ（1 行 1 バイト、最上位ビットが左端）の立っている画素を塗る */
+    virtual void WriteGlyph(Vector2D<int> pos, const uint8_t *glyph, const PixelColor &c);
     virtual int Width() const = 0;
     virtual int Height() const = 0;
 };
@@ -101,29 +245,46 @@ public:
     virtual int Height() const override { return config_.vertical_resolution; }
 
 protected:
-    uint8_t *PixelAt(int x, int y)
-    {
-        return config_.frame_buffer + 4 * (config_.pixels_per_scan_line * y + x);
-    }
-
-private:
     const FrameBufferConfig &config_;
 };
 
-class RGBResv8BitPerColorPixelWriter : public FrameBufferWriter
+/** @brief 画素の形式ごとに特殊化したフレームバッファへの書き込み。
+ *
+ * 各操作は仮想関数の呼び出し 1 回で形式が決まり、画素ごとの処理はインライン展開される。
+ */
+template <PixelFormat kFormat>
+class PixelFormatWriter : public FrameBufferWriter
 {
 public:
+    using Traits = PixelTraits<kFormat>;
     using FrameBufferWriter::FrameBufferWriter;
     virtual void Write(Vector2D<int> pos, const PixelColor &c) override;
-};
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor &c) override;
+    virtual void WriteGlyph(Vector2D<int> pos, const uint8_t *glyph, const PixelColor &c) override;
 
-class BGRResv8BitPerColorPixelWriter : public FrameBufferWriter
-{
-public:
-    using FrameBufferWriter::FrameBufferWriter;
-    virtual void Write(Vector2D<int> pos, const PixelColor &c) override;
+private:
+    uint8_t *PixelAt(int x, int y)
+    {
+        return config_.frame_buffer + Traits::kBytesPerPixel * (config_.pixels_per_scan_line * y + x);
+    }
 };
 
+extern template class PixelFormatWriter<kPixelRGBResv8BitPerColor>;
+extern template class PixelFormatWriter<kPixelBGRResv8BitPerColor>;
+extern template class PixelFormatWriter<kPixelBGR8BitPerColor>;
+extern template class PixelFormatWriter<kPixelRGB565>;
+
+using RGBResv8BitPerColorPixelWriter = PixelFormatWriter<kPixelRGBResv8BitPerColor>;
+using BGRResv8BitPerColorPixelWriter = PixelFormatWriter<kPixelBGRResv8BitPerColor>;
+
+/** @brief format に合わせた書き込みを buf に作る。buf は PixelFormatWriter 1 つ分の大きさが要る */
+FrameBufferWriter *NewFrameBufferWriter(void *buf, const FrameBufferConfig &config);
+
+/** @brief 4 バイトの画素 count 個を value で埋める */
+void FillPixels32(uint32_t *dst, int count, uint32_t value);
+/** @brief 矩形を書き込み先 (0, 0)-(width, height) の内側に切り詰める */
+Rectangle<int> ClipRect(Vector2D<int> pos, Vector2D<int> size, int width, int height);
+
 void FillRectangle(PixelWriter &writer, const Vector2D<int> &pos,
                    const Vector2D<int> &size, const PixelColor &c);
 void DrawRectangle(PixelWriter &writer, const Vector2D<int> &pos,
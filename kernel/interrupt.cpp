@@ -69,6 +69,23 @@ __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame *frame)
     NotifyEndOfInterrupt();
 }
 
+__attribute__((interrupt)) void IntHandlerReschedule(InterruptFrame *frame)
+{
+    // hlt から起きたアイドルタスクが実行可能なタスクに譲る。
+    // 切り替えが必要ならこの CPU のタスク切り替えの期限を設定する。
+    // 先に実行すべきリアルタイムタスクが入ったならすぐに切り替える
+    if (task_manager->NeedsPreemption())
+    {
+        timer_manager->ArmTaskTimer(timer_manager->CurrentTick());
+    }
+    else if (task_manager->NumRunnable() > 1)
+    {
+        timer_manager->ArmTaskTimer();
+    }
+    timer_manager->Reprogram();
+    NotifyEndOfInterrupt();
+}
+
 // __attribute__((interrupt)) void IntHandlerLAPICTimer(InterruptFrame *frame)
 // {
 //     LAPICTimerOnInterrupt();
@@ -88,6 +105,7 @@ void InitializeInterrupt()
 
     set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
     set_idt_entry(InterruptVector::kLAPICTimer, IntHandlerLAPICTimer);
+    set_idt_entry(InterruptVector::kReschedule, IntHandlerReschedule);
     set_idt_entry(0, IntHandlerDE);
     set_idt_entry(1, IntHandlerDB);
     set_idt_entry(3, IntHandlerBP);
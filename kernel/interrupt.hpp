@@ -96,6 +96,8 @@ public:
     {
         kXHCI = 0x40,
         kLAPICTimer = 0x41,
+        // 他の CPU から、実行キューへタスクを入れたことやタイマの期限が早まったことを知らせる
+        kReschedule = 0x42,
     };
 };
 
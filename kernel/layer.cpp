@@ -1,5 +1,6 @@
 #include "layer.hpp"
 #include "console.hpp"
+#include "timer.hpp"
 #include <algorithm>
 #include <iterator>
 
@@ -42,7 +43,7 @@ void Layer::DrawTo(FrameBuffer &buffer, const Rectangle<int> &area) const
 {
     if (window_)
     {
-        window_->DrawTo(buffer, pos_, area);
+        window_->DrawTo(buffer, pos_, area, alpha_);
     }
 }
 
@@ -52,6 +53,22 @@ Layer &Layer::SetDraggable(bool draggable)
     return *this;
 }
 
+bool Layer::IsOpaque() const
+{
+    return alpha_ == 255 && window_ && window_->IsOpaque();
+}
+
+Layer &Layer::SetAlpha(uint8_t alpha)
+{
+    alpha_ = alpha;
+    return *this;
+}
+
+uint8_t Layer::Alpha() const
+{
+    return alpha_;
+}
+
 bool Layer::IsDraggable() const
 {
     return draggable_;
@@ -66,6 +83,169 @@ void LayerManager::SetFrameBuffer(FrameBuffer *buffer)
     back_buffer_.Initialize(back_config);
 }
 
+namespace
+{
+    bool IsEmpty(const Rectangle<int> &r)
+    {
+        return r.size.x <= 0 || r.size.y <= 0;
+    }
+
+    /** @brief a から b と重なる部分を除いた残りを、最大 4 つの矩形として out に加える */
+    void Subtract(const Rectangle<int> &a, const Rectangle<int> &b, std::vector<Rectangle<int>> &out)
+    {
+        const auto inter = a & b;
+        if (IsEmpty(inter))
+        {
+            out.push_back(a);
+            return;
+        }
+
+        const auto a_end = a.pos + a.size;
+        const auto inter_end = inter.pos + inter.size;
+        const Rectangle<int> pieces[] = {
+            {a.pos, {a.size.x, inter.pos.y - a.pos.y}},                            // 上
+            {{a.pos.x, inter_end.y}, {a.size.x, a_end.y - inter_end.y}},           // 下
+            {{a.pos.x, inter.pos.y}, {inter.pos.x - a.pos.x, inter.size.y}},       // 左
+            {{inter_end.x, inter.pos.y}, {a_end.x - inter_end.x, inter.size.y}},   // 右
+        };
+        for (const auto &piece : pieces)
+        {
+            if (!IsEmpty(piece))
+            {
+                out.push_back(piece);
+            }
+        }
+    }
+}
+
+void DamageRegion::Add(const Rectangle<int> &rect)
+{
+    if (IsEmpty(rect))
+    {
+        return;
+    }
+
+    pieces_.assign(1, rect);
+    for (const auto &existing : rects_)
+    {
+        rest_.clear();
+        for (const auto &piece : pieces_)
+        {
+            Subtract(piece, existing, rest_);
+        }
+        pieces_.swap(rest_);
+        if (pieces_.empty())
+        {
+            return; // 既に全部入っている
+        }
+    }
+    rects_.insert(rects_.end(), pieces_.begin(), pieces_.end());
+    Coalesce();
+
+    if (rects_.size() > kMaxRects)
+    {
+        auto start = rects_[0].pos;
+        auto end = rects_[0].pos + rects_[0].size;
+        for (const auto &r : rects_)
+        {
+            start = ElementMin(start, r.pos);
+            end = ElementMax(end, r.pos + r.size);
+        }
+        rects_.assign(1, {start, end - start});
+    }
+}
+
+void DamageRegion::Coalesce()
+{
+    // 同じ幅で上下に接する矩形、同じ高さで左右に接する矩形を 1 つにまとめる
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+        for (size_t i = 0; i < rects_.size() && !merged; ++i)
+        {
+            for (size_t j = i + 1; j < rects_.size() && !merged; ++j)
+            {
+                auto &a = rects_[i];
+                const auto &b = rects_[j];
+                if (a.pos.x == b.pos.x && a.size.x == b.size.x &&
+                    (a.pos.y + a.size.y == b.pos.y || b.pos.y + b.size.y == a.pos.y))
+                {
+                    a.pos.y = std::min(a.pos.y, b.pos.y);
+                    a.size.y += b.size.y;
+                    merged = true;
+                }
+                else if (a.pos.y == b.pos.y && a.size.y == b.size.y &&
+                         (a.pos.x + a.size.x == b.pos.x || b.pos.x + b.size.x == a.pos.x))
+                {
+                    a.pos.x = std::min(a.pos.x, b.pos.x);
+                    a.size.x += b.size.x;
+                    merged = true;
+                }
+                if (merged)
+                {
+                    rects_.erase(rects_.begin() + j);
+                }
+            }
+        }
+    }
+}
+
+void CursorPlane::SetShape(const Window &shape, PixelColor transparent_color, PixelFormat format)
+{
+    size_ = shape.Size();
+    const int bytes_per_pixel = BytesPerPixel(format);
+    pixels_.assign(static_cast<size_t>(bytes_per_pixel) * size_.x * size_.y, 0);
+    VisitPixelFormat(format, [&](auto traits) {
+        using Traits = decltype(traits);
+        constexpr int kBytes = Traits::kBytesPerPixel;
+        uint8_t *p = pixels_.data();
+        for (int y = 0; y < size_.y; ++y)
+        {
+            for (int x = 0; x < size_.x; ++x, p += kBytes)
+            {
+                StorePixel<kBytes>(p, Traits::Pack(shape.At(x, y)));
+            }
+        }
+    });
+    // 画面の形式では透過色と区別できない色（RGB565 の黒など）があるので、変換する前の色で比べる
+    runs_.BuildIf(size_, [&](int x, int y) { return shape.At(x, y) != transparent_color; });
+
+    FrameBufferConfig config{};
+    config.frame_buffer = nullptr;
+    config.horizontal_resolution = size_.x;
+    config.vertical_resolution = size_.y;
+    config.pixel_format = format;
+    if (auto err = plane_.Initialize(config))
+    {
+        printk("Failed to initialize cursor plane: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+        pixels_.clear();
+    }
+}
+
+void CursorPlane::DrawTo(FrameBuffer &dst, const FrameBuffer &under, const Rectangle<int> &area)
+{
+    const auto under_config = under.Config();
+    const auto draw_area = ClipRect(area.pos, area.size, under_config.horizontal_resolution,
+                                    under_config.vertical_resolution) &
+                           Area();
+    if (!HasShape() || IsEmpty(draw_area))
+    {
+        return;
+    }
+
+    // 下の画素を作業領域へ写し、その上に不透明な区間だけ重ねてから画面へ写す
+    const Rectangle<int> plane_area{draw_area.pos - pos_, draw_area.size};
+    plane_.Copy(plane_area.pos, under, draw_area);
+    const auto plane_config = plane_.Config();
+    const int bytes_per_pixel = BytesPerPixel(plane_config.pixel_format);
+    const size_t bytes_per_line = static_cast<size_t>(bytes_per_pixel) * plane_config.pixels_per_scan_line;
+    runs_.Blit(plane_config.frame_buffer + bytes_per_line * plane_area.pos.y + bytes_per_pixel * plane_area.pos.x,
+               bytes_per_line, pixels_.data(), static_cast<size_t>(bytes_per_pixel) * size_.x,
+               bytes_per_pixel, plane_area);
+    dst.Copy(draw_area.pos, plane_, plane_area);
+}
+
 Layer &LayerManager::NewLayer()
 {
     ++latest_id_;
@@ -89,31 +269,54 @@ Layer *LayerManager::FindLayer(unsigned int id)
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_position)
 {
-    auto layer = FindLayer(id);
-    const auto window_size = layer->GetWindow()->Size();
-    const auto old_pos = layer->GetPosition();
-    layer->Move(new_position);
-    Draw({old_pos, window_size});
-    Draw(id);
+    // 元の位置と新しい位置を合わせた領域を、重なりは 1 回だけ描き直す
+    const auto old_area = LayerArea(id);
+    FindLayer(id)->Move(new_position);
+    AddDamage(old_area);
+    AddDamage(LayerArea(id));
+    Commit();
 }
 
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff)
 {
-    auto layer = FindLayer(id);
-    const auto window_size = layer->GetWindow()->Size();
-    const auto old_pos = layer->GetPosition();
-    layer->MoveRelative(pos_diff);
-    Draw({old_pos, window_size});
-    Draw(id);
+    const auto old_area = LayerArea(id);
+    FindLayer(id)->MoveRelative(pos_diff);
+    AddDamage(old_area);
+    AddDamage(LayerArea(id));
+    Commit();
 }
 
-void LayerManager::Draw(const Rectangle<int> &area) const
+void LayerManager::SetCursor(const Window &shape, PixelColor transparent_color)
 {
-    for (auto layer : layer_stack_)
+    cursor_.SetShape(shape, transparent_color, back_buffer_.Config().pixel_format);
+    cursor_.DrawTo(*screen_, back_buffer_, cursor_.Area());
+}
+
+void LayerManager::MoveCursor(Vector2D<int> position)
+{
+    // カーソルは合成タスクを待たずにすぐ動かす。下の画素はバックバッファにあるので、
+    // 元の位置を戻すコピーと新しい位置に重ねるコピーの 2 回で済む
+    const auto old_area = cursor_.Area();
+    cursor_.Move(position);
+    const auto new_area = cursor_.Area();
+    if (!IsEmpty(old_area & new_area))
     {
-        layer->DrawTo(back_buffer_, area);
+        // 重なるときは両方を囲む矩形をまとめて 1 回で描き直す
+        const auto start = ElementMin(old_area.pos, new_area.pos);
+        const auto end = ElementMax(old_area.pos + old_area.size, new_area.pos + new_area.size);
+        const Rectangle<int> area{start, end - start};
+        screen_->Copy(area.pos, back_buffer_, area);
+        cursor_.DrawTo(*screen_, back_buffer_, area);
+        return;
     }
-    screen_->Copy(area.pos, back_buffer_, area);
+    screen_->Copy(old_area.pos, back_buffer_, old_area);
+    cursor_.DrawTo(*screen_, back_buffer_, new_area);
+}
+
+void LayerManager::Draw(const Rectangle<int> &area) const
+{
+    AddDamage(area);
+    Commit();
 }
 
 void LayerManager::Draw(unsigned int id) const
@@ -123,27 +326,105 @@ void LayerManager::Draw(unsigned int id) const
 
 void LayerManager::Draw(unsigned int id, Rectangle<int> area) const
 {
-    bool draw = false;
-    Rectangle<int> window_area;
-    for (auto layer : layer_stack_)
+    auto window_area = LayerArea(id);
+    if (area.size.x >= 0 || area.size.y >= 0)
     {
-        if (layer->ID() == id)
+        area.pos = area.pos + window_area.pos;
+        window_area = window_area & area;
+    }
+    AddDamage(window_area);
+    Commit();
+}
+
+void LayerManager::AddDamage(const Rectangle<int> &area) const
+{
+    ++damage_requests_;
+    const auto config = back_buffer_.Config();
+    damage_.Add(ClipRect(area.pos, area.size,
+                         config.horizontal_resolution, config.vertical_resolution));
+}
+
+void LayerManager::SetDeferredFlush(bool deferred)
+{
+    deferred_flush_ = deferred;
+}
+
+void LayerManager::Commit() const
+{
+    if (!deferred_flush_)
+    {
+        Flush();
+    }
+}
+
+bool LayerManager::Flush() const
+{
+    if (damage_.Empty())
+    {
+        return false;
+    }
+
+    for (const auto &area : damage_.Rects())
+    {
+        // 上のレイヤから順に、まだ隠されていない部分を求める。不透明なレイヤに
+        // 隠された部分はそれより下では描かない。透過するレイヤは下を隠さない
+        draw_ops_.clear();
+        visible_.assign(1, area);
+        for (auto it = layer_stack_.rbegin(); it != layer_stack_.rend() && !visible_.empty(); ++it)
         {
-            window_area.size = layer->GetWindow()->Size();
-            window_area.pos = layer->GetPosition();
-            if (area.size.x >= 0 || area.size.y >= 0)
+            const Layer *layer = *it;
+            if (!layer->GetWindow())
+            {
+                continue;
+            }
+            const Rectangle<int> layer_area{layer->GetPosition(), layer->GetWindow()->Size()};
+            const bool opaque = layer->IsOpaque();
+            visible_next_.clear();
+            for (const auto &r : visible_)
             {
-                area.pos = area.pos + window_area.pos;
-                window_area = window_area & area;
+                const auto inter = r & layer_area;
+                if (IsEmpty(inter))
+                {
+                    visible_next_.push_back(r);
+                    continue;
+                }
+                draw_ops_.emplace_back(layer, inter);
+                if (opaque)
+                {
+                    Subtract(r, layer_area, visible_next_);
+                }
+                else
+                {
+                    visible_next_.push_back(r);
+                }
             }
-            draw = true;
+            visible_.swap(visible_next_);
+        }
+
+        // 下のレイヤから描く
+        for (auto it = draw_ops_.rbegin(); it != draw_ops_.rend(); ++it)
+        {
+            it->first->DrawTo(back_buffer_, it->second);
         }
-        if (draw)
+        screen_->Copy(area.pos, back_buffer_, area);
+        // カーソルは画面へ写した後で重ね直す
+        cursor_.DrawTo(*screen_, back_buffer_, area);
+    }
+    damage_.Clear();
+    return true;
+}
+
+Rectangle<int> LayerManager::LayerArea(unsigned int id) const
+{
+    // 表示していないレイヤは画面上に領域を持たない
+    for (auto layer : layer_stack_)
+    {
+        if (layer->ID() == id && layer->GetWindow())
         {
-            layer->DrawTo(back_buffer_, window_area);
+            return {layer->GetPosition(), layer->GetWindow()->Size()};
         }
     }
-    screen_->Copy(window_area.pos, back_buffer_, window_area);
+    return {{0, 0}, {0, 0}};
 }
 
 void LayerManager::Hide(unsigned int id)
@@ -257,16 +538,11 @@ void InitializeLayer() {
     layer_manager->UpDown(GetConsole().LayerID(), 1);
 
     active_layer = new ActiveLayer(*layer_manager);
-    // layer_task_map = &std::map<unsigned int, uint64_t>{};
+    layer_task_map = new std::map<unsigned int, uint64_t>;
 }
 
 ActiveLayer::ActiveLayer(LayerManager& manager) : manager_{manager} {}
 
-void ActiveLayer::SetMouseLayer(unsigned int mouse_layer)
-{
-    mouse_layer_ = mouse_layer;
-}
-
 void ActiveLayer::Activate(unsigned int layer_id)
 {
     if (active_layer_ == layer_id)
@@ -288,13 +564,14 @@ void ActiveLayer::Activate(unsigned int layer_id)
         printk("Activate layer %d...\n", layer_id);
         Layer* layer = manager_.FindLayer(active_layer_);
         layer->GetWindow()->Activate();
-        manager_.UpDown(active_layer_, manager_.GetHeight(mouse_layer_) - 1);
+        manager_.UpDown(active_layer_, std::numeric_limits<int>::max());
         manager_.Draw(active_layer_);
     }
 }
 
 ActiveLayer* active_layer;
 std::map<unsigned int, uint64_t>* layer_task_map;
+Mutex layer_mutex{"layer"};
 
 std::shared_ptr<Window> GetBgWindow() {
     return desktop_window;
@@ -318,4 +595,60 @@ void ProcessLayerMessage(const Message& msg)
             layer_manager->Draw(arg.layer_id, {{arg.x, arg.y}, {arg.w, arg.h}});
             break;
     }
+}
+
+namespace
+{
+    CompositorStats compositor_stats{};
+}
+
+void TaskCompositor(uint64_t task_id, int64_t data)
+{
+    Task &task = task_manager->CurrentTask();
+    // リアルタイムの予算は使わない。Flush の途中で予算が尽きると layer_mutex を持ったまま
+    // 次の周期まで止められ、画面を描こうとする他のタスクも巻き添えで待たされるため
+    {
+        LockGuard<Mutex> lock{layer_mutex};
+        layer_manager->SetDeferredFlush(true);
+    }
+
+    unsigned long next_frame = timer_manager->CurrentTick() + kFrameTicks;
+    while (true)
+    {
+        // メッセージは受け取らないが、届いても次のフレームまで待ち直す
+        while (timer_manager->CurrentTick() < next_frame)
+        {
+            task.WaitMessage(next_frame);
+        }
+
+        {
+            LockGuard<Mutex> lock{layer_mutex};
+            if (layer_manager->Flush())
+            {
+                ++compositor_stats.frames_drawn;
+            }
+            else
+            {
+                ++compositor_stats.frames_idle;
+            }
+        }
+
+        // 遅れて間に合わなかったフレームは飛ばし、次のフレームの境目に合わせ直す
+        next_frame += kFrameTicks;
+        const auto now = timer_manager->CurrentTick();
+        if (now >= next_frame)
+        {
+            const unsigned long late = (now - next_frame) / kFrameTicks + 1;
+            compositor_stats.frames_late += late;
+            next_frame += late * kFrameTicks;
+        }
+    }
+}
+
+CompositorStats GetCompositorStats()
+{
+    LockGuard<Mutex> lock{layer_mutex};
+    auto stats = compositor_stats;
+    stats.damage_requests = layer_manager->DamageRequests();
+    return stats;
 }
\ No newline at end of file
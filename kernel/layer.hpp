@@ -7,6 +7,8 @@
 #include "window.hpp"
 #include "interrupt.hpp"
 #include "frame_buffer.hpp"
+#include "task.hpp"
+#include "timer.hpp"
 
 class Layer
 {
@@ -22,6 +24,11 @@ public:
     Layer &MoveRelative(Vector2D<int> pos_diff);
 
     void DrawTo(FrameBuffer &screen, const Rectangle<int> &area) const;
+    bool IsOpaque() const;
+
+    /** @brief レイヤ全体の不透明度 (0: 描かない ～ 255: 不透明)。ウィンドウの画素ごとの不透明度と掛け合わせる */
+    Layer &SetAlpha(uint8_t alpha);
+    uint8_t Alpha() const;
 
     Layer &SetDraggable(bool draggable);
     bool IsDraggable() const;
@@ -31,6 +38,52 @@ private:
     Vector2D<int> pos_;
     std::shared_ptr<Window> window_;
     bool draggable_{false};
+    uint8_t alpha_{255};
+};
+
+/** @brief 描き直しが必要な画面上の領域。互いに重ならない矩形の集まりとして持つ。
+ *
+ * 追加する矩形は既にある矩形と重なる部分を除いてから加えるので、各画素は 1 回だけ合成される。
+ * 隣り合って 1 つの矩形にできるものはまとめ、数が kMaxRects を超えたら全体を囲む 1 つの矩形にする。
+ */
+class DamageRegion
+{
+public:
+    static const int kMaxRects = 32;
+
+    void Add(const Rectangle<int> &rect);
+    void Clear() { rects_.clear(); }
+    bool Empty() const { return rects_.empty(); }
+    const std::vector<Rectangle<int>> &Rects() const { return rects_; }
+
+private:
+    std::vector<Rectangle<int>> rects_{};
+    // Add で使う作業領域（呼ぶたびに確保し直さない）
+    std::vector<Rectangle<int>> pieces_{}, rest_{};
+    void Coalesce();
+};
+
+/** @brief 他のレイヤとは別に、合成の最後に画面へ重ねるマウスカーソル。
+ *
+ * 形は画面の形式の画素と、各行の不透明な区間にあらかじめ変換しておく。
+ * カーソルの下の画素はバックバッファに合成済みなので、そこを退避先 (save-under) として使う。
+ */
+class CursorPlane
+{
+public:
+    /** @brief shape の画素を format に変換して取り込む。transparent_color の画素は描かない */
+    void SetShape(const Window &shape, PixelColor transparent_color, PixelFormat format);
+    bool HasShape() const { return !pixels_.empty(); }
+    Rectangle<int> Area() const { return {pos_, size_}; }
+    void Move(Vector2D<int> pos) { pos_ = pos; }
+    /** @brief 画面上の area のうちカーソルと重なる部分を、under の画素にカーソルを重ねて dst へ写す */
+    void DrawTo(FrameBuffer &dst, const FrameBuffer &under, const Rectangle<int> &area);
+
+private:
+    Vector2D<int> pos_{0, 0}, size_{0, 0};
+    std::vector<uint8_t> pixels_{}; // 画面の形式のカーソルの画素
+    OpaqueRuns runs_{};             // 各行の不透明な画素の区間
+    FrameBuffer plane_{};           // 下の画素にカーソルを重ねる作業領域
 };
 
 class LayerManager
@@ -38,12 +91,31 @@ class LayerManager
 public:
     void SetFrameBuffer(FrameBuffer *buffer);
     Layer &NewLayer();
+    /** @brief 画面上の area を描き直す */
     void Draw(const Rectangle<int> &area) const;
+    /** @brief レイヤ id のウィンドウ全体を描き直す */
     void Draw(unsigned int id) const;
+    /** @brief レイヤ id のウィンドウの中の area（ウィンドウ内の座標）を描き直す */
     void Draw(unsigned int id, Rectangle<int> area) const;
+    /** @brief 画面上の area を描き直す領域に加える。描くのは Flush のとき */
+    void AddDamage(const Rectangle<int> &area) const;
+    /** @brief 溜まった領域を、各画素 1 回ずつ合成して画面へ写す。描いたら true */
+    bool Flush() const;
+    /** @brief true にすると Draw や Move は領域を溜めるだけにし、画面へは Flush でまとめて写す。
+     *
+     * 合成タスク (TaskCompositor) が動き出してから使う。それまでは呼ぶたびに画面へ写す。
+     */
+    void SetDeferredFlush(bool deferred);
+    /** @brief これまでに AddDamage された回数 */
+    uint64_t DamageRequests() const { return damage_requests_; }
     void Move(unsigned int id, Vector2D<int> new_position);
     void MoveRelative(unsigned int id, Vector2D<int> pos_diff);
 
+    /** @brief マウスカーソルの形を決めて画面に出す。shape の transparent_color の画素は描かない */
+    void SetCursor(const Window &shape, PixelColor transparent_color);
+    /** @brief カーソルを動かす。元の位置をバックバッファから戻し、新しい位置に重ねるだけで、下のレイヤは合成し直さない */
+    void MoveCursor(Vector2D<int> position);
+
     void UpDown(unsigned int id, int new_height);
     void Hide(unsigned int id);
 
@@ -57,35 +129,62 @@ public:
 private:
     FrameBuffer *screen_{nullptr};
     mutable FrameBuffer back_buffer_{};
+    mutable DamageRegion damage_{};
+    bool deferred_flush_{false};
+    mutable uint64_t damage_requests_{0};
+    void Commit() const;
+    mutable CursorPlane cursor_{};
+    // 合成に使う作業領域（Flush のたびに確保し直さない）
+    mutable std::vector<Rectangle<int>> visible_{}, visible_next_{};
+    mutable std::vector<std::pair<const Layer *, Rectangle<int>>> draw_ops_{};
+    Rectangle<int> LayerArea(unsigned int id) const;
     std::vector<std::unique_ptr<Layer>> layers_{};
     std::vector<Layer *> layer_stack_{};
     unsigned int latest_id_{0};
 };
 
 extern LayerManager *layer_manager;
+// 本物のフレームバッファ
+extern FrameBuffer screen;
 
 class ActiveLayer 
 {
     public:
         ActiveLayer(LayerManager& manager);
-        void SetMouseLayer(unsigned int mouse_layer);
         void Activate(unsigned int layer_id);
         unsigned int GetActive() const { return active_layer_; }
 
     private:
         LayerManager& manager_;
         unsigned int active_layer_{0};
-        unsigned int mouse_layer_{0};
 };
 
 extern ActiveLayer* active_layer;
 extern std::map<unsigned int, uint64_t>* layer_task_map;
+// layer_manager, active_layer, layer_task_map を複数のタスクから操作するときに取る
+extern Mutex layer_mutex;
 
 void InitializeLayer();
 std::shared_ptr<Window> GetBgWindow();
 
 void ProcessLayerMessage(const Message& msg);
 
+/** @brief 合成タスクの統計 */
+struct CompositorStats
+{
+    uint64_t frames_drawn;    // 画面へ写したフレーム
+    uint64_t frames_idle;     // 描き直す領域が無く、何もしなかったフレーム
+    uint64_t frames_late;     // 合成タスクの実行が遅れて飛ばしたフレーム
+    uint64_t damage_requests; // Draw や Move で溜めた領域の数（これをフレームにまとめる）
+};
+
+// 合成タスクが画面へ写す間隔 (tick)。約 60 Hz
+const int kFrameTicks = kTimerFreq / 60;
+
+/** @brief kFrameTicks ごとに、溜まった領域をまとめて画面へ写すタスク */
+void TaskCompositor(uint64_t task_id, int64_t data);
+CompositorStats GetCompositorStats();
+
 constexpr Message MakeLayerMessage(
     uint64_t task_id,
     unsigned int layer_id,
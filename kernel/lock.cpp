@@ -0,0 +1,106 @@
+#include "lock.hpp"
+
+#include <algorithm>
+#include "asmfunc.h"
+#include "smp.hpp"
+
+namespace
+{
+  std::atomic<LockStats *> lock_stats_head{nullptr};
+
+  // newlib の malloc / free を複数の CPU から呼ぶためのロック。
+  // malloc の中から再び取られることがあるので、同じ CPU なら再帰的に取れるようにする。
+  // 割り込み禁止で保持するので、保持中の CPU が変わったりハンドラが割り込んだりしない
+  SpinLock malloc_lock{"malloc"};
+  std::atomic<int> malloc_lock_owner{-1};
+  int malloc_lock_depth = 0;
+  uint64_t malloc_lock_rflags = 0;
+}
+
+void LockStats::Record(uint64_t hold_tsc, bool contended)
+{
+  ++acquisitions;
+  if (contended)
+  {
+    ++contentions;
+  }
+  total_hold_tsc += hold_tsc;
+  max_hold_tsc = std::max(max_hold_tsc, hold_tsc);
+
+  if (!registered && name)
+  {
+    registered = true;
+    next = lock_stats_head.load(std::memory_order_relaxed);
+    while (!lock_stats_head.compare_exchange_weak(next, this, std::memory_order_release))
+    {
+    }
+  }
+}
+
+LockStats *LockStatsList()
+{
+  return lock_stats_head.load(std::memory_order_acquire);
+}
+
+void SpinLock::Lock()
+{
+  bool contended = false;
+  while (locked_.exchange(true, std::memory_order_acquire))
+  {
+    contended = true;
+    // 解放されるまでは読むだけにして、キャッシュラインの奪い合いを避ける
+    while (locked_.load(std::memory_order_relaxed))
+    {
+      __builtin_ia32_pause();
+    }
+  }
+  contended_ = contended;
+  acquired_tsc_ = ReadTSC();
+}
+
+bool SpinLock::TryLock()
+{
+  if (locked_.load(std::memory_order_relaxed) ||
+      locked_.exchange(true, std::memory_order_acquire))
+  {
+    return false;
+  }
+  contended_ = false;
+  acquired_tsc_ = ReadTSC();
+  return true;
+}
+
+void SpinLock::Unlock()
+{
+  stats_.Record(ReadTSC() - acquired_tsc_, contended_);
+  locked_.store(false, std::memory_order_release);
+}
+
+extern "C" void __malloc_lock(struct _reent *)
+{
+  const auto rflags = SaveAndDisableInterrupts();
+  const int cpu = CurrentCPU();
+  if (malloc_lock_owner.load(std::memory_order_relaxed) == cpu)
+  {
+    ++malloc_lock_depth;
+    return;
+  }
+
+  malloc_lock.Lock();
+  malloc_lock_owner.store(cpu, std::memory_order_relaxed);
+  malloc_lock_depth = 1;
+  malloc_lock_rflags = rflags;
+}
+
+extern "C" void __malloc_unlock(struct _reent *)
+{
+  if (--malloc_lock_depth > 0)
+  {
+    return;
+  }
+
+  const auto rflags = malloc_lock_rflags;
+  malloc_lock_owner.store(-1, std::memory_order_relaxed);
+  malloc_lock.Unlock();
+  RestoreInterrupts(rflags);
+}
\ No newline at end of file
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/** @brief ロックの統計。保持時間は TSC のカウントで記録する。
+ *
+ * 名前付きのロックは初めて解放されたときに一覧へ登録され、LockStatsList() でたどれる。
+ * 更新はロックを保持したまま行うので、統計自体にロックは要らない。
+ */
+struct LockStats
+{
+  const char *name;
+  uint64_t acquisitions;
+  uint64_t contentions; // 取得時に待たされた回数
+  uint64_t total_hold_tsc;
+  uint64_t max_hold_tsc;
+  LockStats *next;
+  bool registered;
+
+  void Record(uint64_t hold_tsc, bool contended);
+};
+
+/** @brief 統計を記録したことのある名前付きロックの一覧の先頭 */
+LockStats *LockStatsList();
+
+/** @brief 割り込みを禁止し、禁止する前の RFLAGS を返す */
+inline uint64_t SaveAndDisableInterrupts()
+{
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) : : "memory");
+  return rflags;
+}
+
+/** @brief SaveAndDisableInterrupts が返した RFLAGS の割り込み許可状態に戻す */
+inline void RestoreInterrupts(uint64_t rflags)
+{
+  if (rflags & 0x200) // IF
+  {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
+
+/** @brief スピンロック。
+ *
+ * 割り込みハンドラと共有するデータには IRQSaveLockGuard で取ること。
+ * 割り込みを許可したまま取ると、保持中に割り込んだハンドラが同じロックで止まる。
+ */
+class SpinLock
+{
+public:
+  constexpr SpinLock(const char *name = nullptr) : stats_{name} {}
+  SpinLock(const SpinLock &) = delete;
+  SpinLock &operator=(const SpinLock &) = delete;
+
+  void Lock();
+  bool TryLock();
+  void Unlock();
+  const LockStats &Stats() const { return stats_; }
+
+private:
+  std::atomic<bool> locked_{false};
+  bool contended_{false};
+  uint64_t acquired_tsc_{0};
+  LockStats stats_;
+};
+
+/** @brief Lock() / Unlock() を持つロックのスコープガード */
+template <class L>
+class LockGuard
+{
+public:
+  explicit LockGuard(L &lock) : lock_{lock} { lock_.Lock(); }
+  ~LockGuard() { lock_.Unlock(); }
+  LockGuard(const LockGuard &) = delete;
+  LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+  L &lock_;
+};
+
+/** @brief 割り込みを禁止してからスピンロックを取るスコープガード。
+ *
+ * 破棄時にロックを外し、割り込み許可状態を元に戻す。
+ * コンテキストスイッチの前には Unlock() でロックだけ先に外す（割り込みは禁止のまま）。
+ */
+class IRQSaveLockGuard
+{
+public:
+  explicit IRQSaveLockGuard(SpinLock &lock)
+      : lock_{lock}, rflags_{SaveAndDisableInterrupts()}
+  {
+    lock_.Lock();
+  }
+  ~IRQSaveLockGuard()
+  {
+    Unlock();
+    RestoreInterrupts(rflags_);
+  }
+  IRQSaveLockGuard(const IRQSaveLockGuard &) = delete;
+  IRQSaveLockGuard &operator=(const IRQSaveLockGuard &) = delete;
+
+  void Unlock()
+  {
+    if (locked_)
+    {
+      locked_ = false;
+      lock_.Unlock();
+    }
+  }
+
+private:
+  SpinLock &lock_;
+  uint64_t rflags_;
+  bool locked_{true};
+};
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <deque>
 #include <optional>
 
@@ -24,6 +25,7 @@
 #include "pci.hpp"
 #include "queue.hpp"
 #include "segment.hpp"
+#include "smp.hpp"
 #include "syscall.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
@@ -38,7 +40,10 @@
 //   return buf;
 // }
 
-void operator delete(void *obj) noexcept {}
+void operator delete(void *obj) noexcept
+{
+  free(obj);
+}
 
 void SwitchEhci2Xhci(const pci::Device &xhc_dev)
 {
@@ -138,6 +143,7 @@ extern "C" void KernelMainNewStack(
   InitializeSegmentation();
   InitializePaging();
   InitializeMemoryManager(memory_map);
+  ReserveAPBootPage();
   InitializeTSS();
   InitializeInterrupt();
 
@@ -174,25 +180,27 @@ extern "C" void KernelMainNewStack(
 
   acpi::Initialize(acpi_table);
   InitializeLAPICTimer();
-  timer_manager->AddTimer(Timer(200, 2));
-  timer_manager->AddTimer(Timer(600,-1));
+  timer_manager->AddTimer(Timer(kTimerFreq * 2, 2));
+  timer_manager->AddTimer(Timer(kTimerFreq * 6, -1));
 
   InitializeClock();
 
   const int kTextboxCursorTimer = -5;
-  const int kTimer500ms = static_cast<int>(kTimerFreq * 0.5);
-  __asm__("cli");
-  timer_manager->AddTimer(Timer{kTimer500ms, kTextboxCursorTimer});
-  __asm__("sti");
+  timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer});
   bool textbox_cursor_visible = false;
 
   InitializeSyscall();
   InitializeTask();
   Task& main_task = task_manager->CurrentTask();
-  const uint64_t task_terminal_id = task_manager->NewTask()
+  // 画面の合成と入力の配送は 10ms ごとに 5ms まで優先して実行する
+  task_manager->SetRealTime(main_task.ID(), 10, 5);
+  StartAPs();
+  task_manager->NewTask()
     .InitContext(TaskTerminal, 0)
-    .Wakeup()
-    .ID();
+    .Wakeup();
+  task_manager->NewTask()
+    .InitContext(TaskCompositor, 0)
+    .Wakeup();
 
   usb::xhci::Initialize();
   InitializeMouse();
@@ -202,23 +210,22 @@ extern "C" void KernelMainNewStack(
 
   while (true)
   {
-    __asm__("cli");
     const auto tick = timer_manager->CurrentTick();
-    __asm__("sti");
     sprintf(str, "%010lu", tick);
     FillRectangle(*main_window->InnerWriter(), {0, 0}, main_window->InnerSize(), {0xc6, 0xc6, 0xc6});
     WriteString(*main_window->InnerWriter(), {0, 0}, str, {0, 0, 0});
-    layer_manager->Draw(main_window_layer_id);
+    {
+      LockGuard<Mutex> lock{layer_mutex};
+      layer_manager->Draw(main_window_layer_id);
+    }
 
-    __asm__("cli");
-    std::optional<Message> msg = main_task.ReceiveMessage();
+    std::optional<Message> msg = main_task.WaitMessage();
     if (!msg)
     {
-      main_task.Sleep();
-      __asm__("sti");
       continue;
     }
-    __asm__("sti");
+
+    LockGuard<Mutex> lock{layer_mutex};
 
     switch (msg->type)
     {
@@ -228,21 +235,15 @@ extern "C" void KernelMainNewStack(
     case Message::kTimerTimeout:
       // printk("Timer timeout: timeout(%lu), value(%d)\n", msg->arg.timer.timeout, msg->arg.timer.value);
       if (msg->arg.timer.value > 0) {
-        timer_manager->AddTimer(Timer(msg->arg.timer.timeout + 100, msg->arg.timer.value + 1));
+        timer_manager->AddTimer(Timer(msg->arg.timer.timeout + kTimerFreq, msg->arg.timer.value + 1));
         DrawClock(*clock_window->Writer());
       }
       if (msg->arg.timer.value == kTextboxCursorTimer) {
-        __asm__("cli");
         timer_manager->AddTimer(
-            Timer{msg->arg.timer.timeout + kTimer500ms, kTextboxCursorTimer});
-        __asm__("sti");
+            Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer});
         textbox_cursor_visible = !textbox_cursor_visible;
         DrawTextCursor(textbox_cursor_visible);
         layer_manager->Draw(text_window_layer_id);
-
-        __asm__("cli");
-        task_manager->SendMessage(task_terminal_id, *msg);
-        __asm__("sti");
       }
       break;
     case Message::kKeyPush:
@@ -254,14 +255,10 @@ extern "C" void KernelMainNewStack(
         InputTextWindow(msg->arg.keyboard.ascii);
       } else
       {
-        __asm__("cli");
         auto task_it = layer_task_map->find(act);
-        __asm__("sti");
         if (task_it != layer_task_map->end())
         {
-          __asm__("cli");
           task_manager->SendMessage(task_it->second, *msg);
-          __asm__("sti");
         }
         else
         {
@@ -272,9 +269,7 @@ extern "C" void KernelMainNewStack(
       break;
     case Message::kLayer:
       ProcessLayerMessage(msg.value());
-      __asm__("cli");
-      task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-      __asm__("sti");
+      task_manager->Reply(msg->src_task, Message{Message::kLayerFinish});
       break;
     default:
       printk("Unknown message type: %d\n", msg->type);
@@ -45,6 +45,7 @@ void BitmapMemoryManager::SetBit(FrameID frame, bool allocated)
 
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames)
 {
+    IRQSaveLockGuard guard{lock_};
     size_t start_frame_id = range_begin_.ID();
     while (true)
     {
@@ -74,6 +75,7 @@ WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames)
 
 Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames)
 {
+    IRQSaveLockGuard guard{lock_};
     for (size_t i = 0; i < num_frames; ++i)
     {
         SetBit(FrameID{start_frame.ID() + i}, false);
@@ -81,8 +83,6 @@ Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames)
     return MAKE_ERROR(Error::kSuccess);
 }
 
-extern "C" caddr_t program_break, program_break_end;
-
 Error InitializeHeap(BitmapMemoryManager &memory_manager)
 {
     const int kHeapFrames = 64 * 512;
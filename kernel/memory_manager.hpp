@@ -3,7 +3,9 @@
 // #include <cstdlib>
 #include <limits>
 #include <array>
+#include <sys/types.h>
 #include "error.hpp"
+#include "lock.hpp"
 #include "memory_map.hpp"
 
 namespace
@@ -57,6 +59,8 @@ public:
     void SetMemoryRange(FrameID range_begin, FrameID range_end);
 
 private:
+    // 複数の CPU から Allocate / Free されるので alloc_map_ を保護する
+    SpinLock lock_{"memory_manager"};
     std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
     FrameID range_begin_;
     FrameID range_end_;
@@ -68,4 +72,6 @@ private:
 extern BitmapMemoryManager *memory_manager;
 
 Error InitializeHeap(BitmapMemoryManager &memory_manager);
+// newlib の sbrk が使うヒープの現在の終わりと上限 (newlib_support.c)
+extern "C" caddr_t program_break, program_break_end;
 void InitializeMemoryManager(MemoryMap memory_map);
\ No newline at end of file
@@ -59,7 +59,6 @@ void DrawMouseCursor(PixelWriter *pixel_writer, Vector2D<int> position)
 }
 
 Vector2D<int> mouse_position;
-unsigned int mouse_layer_id;
 
 void MouseObserver(uint8_t buttons, int8_t displacement_x, int8_t displacement_y)
 {
@@ -75,7 +74,7 @@ void MouseObserver(uint8_t buttons, int8_t displacement_x, int8_t displacement_y
 
   const auto posdiff = mouse_position - oldpos;
 
-  layer_manager->Move(mouse_layer_id, mouse_position);
+  layer_manager->MoveCursor(mouse_position);
 
   const bool previous_left_pressed = (previous_buttons & 0x01);
   const bool left_pressed = (buttons & 0x01);
@@ -83,7 +82,7 @@ void MouseObserver(uint8_t buttons, int8_t displacement_x, int8_t displacement_y
   if (!previous_left_pressed && left_pressed)
   {
     // ボタンが押された
-    auto layer = layer_manager->FindLayerByPosition(mouse_position, mouse_layer_id);
+    auto layer = layer_manager->FindLayerByPosition(mouse_position, 0);
     if (layer && layer->IsDraggable())
     {
       printk("Activate draggable layer %d\n", layer->ID());
@@ -110,17 +109,19 @@ void MouseObserver(uint8_t buttons, int8_t displacement_x, int8_t displacement_y
 }
 
 void InitializeMouse() {
-    auto mouse_window = std::make_shared<Window>(
-        kMouseCursorWidth, kMouseCursorHeight, GetFrameBufferConfig().pixel_format);
-    mouse_window->SetTransparentColor(kMouseTransparentColor);
-    mouse_layer_id =
-        layer_manager->NewLayer().SetWindow(mouse_window).Move({200, 200}).ID();
+    // カーソルはレイヤにせず、この形を取り込んだ専用のプレーンとして最後に重ねる。
+    // 透過色を正確に見分けられるよう、形は画面の形式によらず 1 色 8 ビットで描く
+    Window mouse_window{kMouseCursorWidth, kMouseCursorHeight, kPixelBGRResv8BitPerColor};
 
     printk("Draw mouse cursor...\n");
 
-    DrawMouseCursor(mouse_window->Writer(), {0, 0});
-    layer_manager->UpDown(mouse_layer_id, std::numeric_limits<int>::max());
+    DrawMouseCursor(mouse_window.Writer(), {0, 0});
+    mouse_position = {200, 200};
+    {
+        LockGuard<Mutex> lock{layer_mutex};
+        layer_manager->SetCursor(mouse_window, kMouseTransparentColor);
+        layer_manager->MoveCursor(mouse_position);
+    }
 
     usb::HIDMouseDriver::default_observer = MouseObserver;
-    active_layer->SetMouseLayer(mouse_layer_id);
 }
\ No newline at end of file
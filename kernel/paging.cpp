@@ -33,4 +33,29 @@ void SetupIdentityPageTable()
 void InitializePaging()
 {
     SetupIdentityPageTable();
-}
\ No newline at end of file
+}
+bool IsUserPage(uint64_t addr)
+{
+    // アプリは上位半分のアドレスにしか置かれない
+    if (addr < 0xffff'8000'0000'0000)
+    {
+        return false;
+    }
+
+    const LinearAddress4Level laddr{addr};
+    auto page_map = reinterpret_cast<const PageMapEntry *>(GetCR3());
+    for (int level = 4; level >= 1; --level)
+    {
+        const auto entry = page_map[laddr.Part(level)];
+        if (!entry.bits.present || !entry.bits.user || !entry.bits.writable)
+        {
+            return false;
+        }
+        if (level == 1 || entry.bits.huge_page)
+        {
+            break;
+        }
+        page_map = entry.Pointer();
+    }
+    return true;
+}
@@ -5,6 +5,9 @@ void SetupIdentityPageTable();
 
 void InitializePaging();
 
+// addr を含むページがアプリから読み書きできるように対応付けられているか
+bool IsUserPage(uint64_t addr);
+
 union LinearAddress4Level
 {
   uint64_t value;
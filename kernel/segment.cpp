@@ -1,13 +1,16 @@
 #include <array>
 #include "segment.hpp"
 #include "asmfunc.h"
+#include "smp.hpp"
 
 namespace
 {
-    std::array<SegmentDescriptor, 7> gdt;
-    std::array<uint32_t, 26> tss;
+    // TSS は CPU ごとに要るので、それを指す GDT も CPU ごとに持つ
+    const size_t kGDTEntries = 7;
+    std::array<std::array<SegmentDescriptor, kGDTEntries>, kMaxCPUs> gdt;
+    std::array<std::array<uint32_t, 26>, kMaxCPUs> tss;
 
-    static_assert((kTSS >> 3) + 1 < gdt.size());
+    static_assert((kTSS >> 3) + 1 < kGDTEntries);
 }
 
 void SetCodeSegment(SegmentDescriptor &desc,
@@ -45,19 +48,20 @@ void SetDataSegment(SegmentDescriptor &desc,
     desc.bits.default_operation_size = 1;
 }
 
-void SetupSegments()
+void SetupSegments(int cpu)
 {
-    gdt[0].data = 0;
-    SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
-    SetDataSegment(gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
-    SetDataSegment(gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff);
-    SetCodeSegment(gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff);
-    LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+    auto& cpu_gdt = gdt[cpu];
+    cpu_gdt[0].data = 0;
+    SetCodeSegment(cpu_gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
+    SetDataSegment(cpu_gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
+    SetDataSegment(cpu_gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff);
+    SetCodeSegment(cpu_gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff);
+    LoadGDT(sizeof(cpu_gdt) - 1, reinterpret_cast<uintptr_t>(&cpu_gdt[0]));
 }
 
-void InitializeSegmentation()
+void InitializeSegmentation(int cpu)
 {
-    SetupSegments();
+    SetupSegments(cpu);
 
     SetDSAll(0);
     SetCSSS(kKernelCS, kKernelSS);
@@ -70,7 +74,7 @@ void SetSystemSegment(SegmentDescriptor &desc, DescriptorType type, unsigned int
     desc.bits.long_mode = 0;
 }
 
-void InitializeTSS()
+void InitializeTSS(int cpu)
 {
     const int kRSP0Frames = 8;
     auto [stack0, err] = memory_manager->Allocate(kRSP0Frames);
@@ -81,12 +85,13 @@ void InitializeTSS()
     }
     uint64_t rsp0 =
         reinterpret_cast<uint64_t>(stack0.Frame()) + kRSP0Frames * 4096;
-    tss[1] = rsp0 & 0xffffffff;
-    tss[2] = rsp0 >> 32;
+    auto& cpu_tss = tss[cpu];
+    cpu_tss[1] = rsp0 & 0xffffffff;
+    cpu_tss[2] = rsp0 >> 32;
 
-    uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
-    SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(tss) - 1);
-    gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+    uint64_t tss_addr = reinterpret_cast<uint64_t>(&cpu_tss[0]);
+    SetSystemSegment(gdt[cpu][kTSS >> 3], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(cpu_tss) - 1);
+    gdt[cpu][(kTSS >> 3) + 1].data = tss_addr >> 32;
 
     LoadTR(kTSS);
 }
\ No newline at end of file
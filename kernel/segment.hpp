@@ -37,10 +37,11 @@ void SetDataSegment(SegmentDescriptor &desc,
                     uint32_t base,
                     uint32_t limit);
 
-void SetupSegments();
+// cpu は CPU 番号。各 CPU が自分で呼ぶ
+void SetupSegments(int cpu = 0);
 
-void InitializeSegmentation();
-void InitializeTSS();
+void InitializeSegmentation(int cpu = 0);
+void InitializeTSS(int cpu = 0);
 
 const uint16_t kKernelCS = 1 << 3;
 const uint16_t kKernelSS = 2 << 3;
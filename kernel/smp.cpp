@@ -0,0 +1,212 @@
+#include "smp.hpp"
+
+#include <atomic>
+#include <cstring>
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "console.hpp"
+#include "interrupt.hpp"
+#include "lock.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "segment.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+int num_cpus = 1;
+std::array<uint8_t, kMaxCPUs> cpu_apic_ids;
+
+namespace
+{
+  volatile uint32_t &lapic_id = *reinterpret_cast<uint32_t *>(0xfee00020);
+  volatile uint32_t &spurious_interrupt_vector = *reinterpret_cast<uint32_t *>(0xfee000f0);
+  volatile uint32_t &icr_low = *reinterpret_cast<uint32_t *>(0xfee00300);
+  volatile uint32_t &icr_high = *reinterpret_cast<uint32_t *>(0xfee00310);
+
+  const uint32_t kICRDeliveryPending = 1u << 12;
+  const uint32_t kICRAssert = 1u << 14;
+  const uint32_t kICRInit = 0b101 << 8;
+  const uint32_t kICRStartup = 0b110 << 8;
+
+  // AP の最初のスタック。起動後はそのままアイドルタスクのスタックになる
+  const int kAPStackFrames = 4;
+
+  // Local APIC ID から CPU 番号を引く。登録していない ID は BSP (0) とみなす
+  std::array<uint8_t, 256> cpu_by_apic_id{};
+  uintptr_t ap_boot_page = 0;
+  std::atomic<bool> ap_started{false};
+
+  void WaitMicroseconds(unsigned long usec)
+  {
+    const uint64_t end = ReadTSC() + tsc_freq / 1000000 * usec;
+    while (ReadTSC() < end)
+    {
+      __builtin_ia32_pause();
+    }
+  }
+
+  void WaitICRIdle()
+  {
+    while (icr_low & kICRDeliveryPending)
+    {
+      __builtin_ia32_pause();
+    }
+  }
+
+  void SendICR(uint8_t apic_id, uint32_t command)
+  {
+    WaitICRIdle();
+    icr_high = static_cast<uint32_t>(apic_id) << 24;
+    icr_low = command;
+    WaitICRIdle();
+  }
+
+  template <class T>
+  T &APBootField(uint8_t *label)
+  {
+    return *reinterpret_cast<T *>(ap_boot_page + (label - ApBootStart));
+  }
+
+  void APMain(uint64_t cpu)
+  {
+    InitializeSegmentation(cpu);
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    InitializeTSS(cpu);
+    InitializeSyscall();
+
+    // INIT 後の LAPIC はソフトウェア無効になっているので有効にする（スプリアス割り込みは 0xff）
+    spurious_interrupt_vector = 0x1ff;
+    InitializeLocalAPICTimer();
+
+    Task &idle = task_manager->InitializeCPU(cpu);
+    ap_started.store(true, std::memory_order_release);
+    TaskIdle(idle.ID(), 0);
+  }
+
+  /** @brief MADT のエントリを順に f(type, entry) へ渡す */
+  template <class F>
+  void ForEachMADTEntry(F f)
+  {
+    auto p = reinterpret_cast<const uint8_t *>(acpi::madt + 1);
+    const auto end = reinterpret_cast<const uint8_t *>(acpi::madt) + acpi::madt->header.length;
+    while (p + 2 <= end && p[1] >= 2)
+    {
+      f(p[0], p);
+      p += p[1];
+    }
+  }
+
+  bool StartAP(int cpu, uint8_t apic_id)
+  {
+    auto [stack, err] = memory_manager->Allocate(kAPStackFrames);
+    if (err)
+    {
+      Log(kError, "failed to allocate AP stack: %s\n", err.Name());
+      return false;
+    }
+    APBootField<uint64_t>(ApBootStack) =
+        reinterpret_cast<uint64_t>(stack.Frame()) + kAPStackFrames * kBytesPerFrame;
+    APBootField<uint64_t>(ApBootCPU) = cpu;
+    cpu_apic_ids[cpu] = apic_id;
+    cpu_by_apic_id[apic_id] = cpu;
+
+    ap_started.store(false);
+    const uint32_t vector = ap_boot_page >> 12;
+    SendICR(apic_id, kICRAssert | kICRInit);
+    WaitMicroseconds(10000);
+    for (int i = 0; i < 2 && !ap_started.load(std::memory_order_acquire); ++i)
+    {
+      SendICR(apic_id, kICRAssert | kICRStartup | vector);
+      WaitMicroseconds(200);
+    }
+
+    for (int i = 0; i < 100 && !ap_started.load(std::memory_order_acquire); ++i)
+    {
+      WaitMicroseconds(1000);
+    }
+    if (!ap_started.load(std::memory_order_acquire))
+    {
+      Log(kWarn, "AP (APIC ID %u) did not start\n", apic_id);
+      cpu_by_apic_id[apic_id] = 0;
+      memory_manager->Free(stack, kAPStackFrames);
+      return false;
+    }
+    return true;
+  }
+}
+
+uint8_t LocalAPICID()
+{
+  return lapic_id >> 24;
+}
+
+int CurrentCPU()
+{
+  return cpu_by_apic_id[LocalAPICID()];
+}
+
+void SendIPI(int cpu, uint8_t vector)
+{
+  // 上位と下位の書き込みの間に割り込みハンドラが IPI を送らないようにする
+  const auto rflags = SaveAndDisableInterrupts();
+  WaitICRIdle();
+  icr_high = static_cast<uint32_t>(cpu_apic_ids[cpu]) << 24;
+  icr_low = kICRAssert | vector;
+  RestoreInterrupts(rflags);
+}
+
+void ReserveAPBootPage()
+{
+  auto [frame, err] = memory_manager->Allocate(1);
+  if (err)
+  {
+    return;
+  }
+  // SIPI のベクタはページ番号の下位 8 ビットなので 1 MiB 未満でないと使えない
+  if (frame.ID() >= 0x100)
+  {
+    memory_manager->Free(frame, 1);
+    Log(kWarn, "no free page below 1 MiB for AP boot code\n");
+    return;
+  }
+  ap_boot_page = reinterpret_cast<uintptr_t>(frame.Frame());
+}
+
+void StartAPs()
+{
+  const uint8_t bsp_id = LocalAPICID();
+  cpu_apic_ids[0] = bsp_id;
+  cpu_by_apic_id[bsp_id] = 0;
+
+  if (acpi::madt == nullptr || ap_boot_page == 0)
+  {
+    printk("SMP is not available\n");
+    return;
+  }
+
+  memcpy(reinterpret_cast<void *>(ap_boot_page), ApBootStart, ApBootEnd - ApBootStart);
+  APBootField<uint32_t>(ApBootGDTR + 2) = ap_boot_page + (ApBootGDT - ApBootStart);
+  APBootField<uint32_t>(ApBootJump + 2) = ap_boot_page + (ApBoot64 - ApBootStart);
+  APBootField<uint32_t>(ApBootCR3) = GetCR3();
+  APBootField<uint64_t>(ApBootEntry) = reinterpret_cast<uint64_t>(APMain);
+
+  ForEachMADTEntry([bsp_id](uint8_t type, const uint8_t *entry)
+  {
+    // Processor Local APIC: ACPI Processor UID, APIC ID, Flags (bit 0: 有効)
+    if (type != 0 || (entry[4] & 1) == 0 || entry[3] == bsp_id)
+    {
+      return;
+    }
+    if (num_cpus >= kMaxCPUs)
+    {
+      Log(kWarn, "too many CPUs: APIC ID %u is ignored\n", entry[3]);
+      return;
+    }
+    if (StartAP(num_cpus, entry[3]))
+    {
+      ++num_cpus;
+    }
+  });
+  printk("%d CPU(s) started\n", num_cpus);
+}
\ No newline at end of file
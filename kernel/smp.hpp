@@ -0,0 +1,26 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+const int kMaxCPUs = 16;
+
+// 起動済みの CPU の数。CPU 番号は 0 (BSP) から num_cpus - 1 まで
+extern int num_cpus;
+// CPU 番号ごとの Local APIC ID
+extern std::array<uint8_t, kMaxCPUs> cpu_apic_ids;
+
+uint8_t LocalAPICID();
+/** @brief 実行中の CPU の番号。タスクが別の CPU へ移らないよう割り込み禁止で使う */
+int CurrentCPU();
+/** @brief cpu へ固定ベクタの IPI を送る */
+void SendIPI(int cpu, uint8_t vector);
+
+/** @brief AP の起動コードを置くページを 1 MiB 未満に確保する。メモリ管理の初期化直後に呼ぶ */
+void ReserveAPBootPage();
+/** @brief ACPI の MADT に載っている AP を INIT-SIPI-SIPI で起動する。
+ *
+ * 起動した AP は自分の GDT/TSS と LAPIC タイマを設定し、アイドルタスクとして
+ * 自分の実行キューのタスクを実行し始める。
+ */
+void StartAPs();
\ No newline at end of file
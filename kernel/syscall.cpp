@@ -1,9 +1,16 @@
+#include <algorithm>
 #include <array>
 #include <cstring>
+#include <limits>
 #include "asmfunc.h"
 #include "console.hpp"
+#include "futex.hpp"
 #include "msr.hpp"
+#include "paging.hpp"
 #include "logger.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
 
 namespace syscall {
 #define SYSCALL(name) \
@@ -23,12 +30,45 @@ namespace syscall {
         return 0;
     }
 
+    SYSCALL(Exit) {
+        // CallApp を呼んだときのカーネルのスタックへ戻り、arg1 を終了コードとして返す
+        ExitApp(task_manager->CurrentTask().OSStackPointer(), static_cast<int32_t>(arg1));
+    }
+
+    // 成功なら 0、失敗なら Error::Code を負にして返す
+    SYSCALL(FutexWait) {
+        const auto addr = reinterpret_cast<const volatile uint32_t*>(arg1);
+        // 境界が揃っていれば 4 バイトがページをまたぐことはない
+        if (arg1 % alignof(uint32_t) != 0 || !IsUserPage(arg1)) {
+            return -static_cast<int64_t>(Error::kBadAddress);
+        }
+        // arg3: 待つ時間 (ms)。0 なら起こされるまで待つ
+        unsigned long timeout = std::numeric_limits<unsigned long>::max();
+        if (arg3 != 0) {
+            timeout = timer_manager->CurrentTick() + (arg3 * kTimerFreq + 999) / 1000;
+        }
+        return -static_cast<int64_t>(::FutexWait(addr, static_cast<uint32_t>(arg2), timeout).Cause());
+    }
+
+    SYSCALL(FutexWake) {
+        const auto addr = reinterpret_cast<const volatile uint32_t*>(arg1);
+        // 境界が揃っていれば 4 バイトがページをまたぐことはない
+        if (arg1 % alignof(uint32_t) != 0 || !IsUserPage(arg1)) {
+            return -static_cast<int64_t>(Error::kBadAddress);
+        }
+        // arg2: 起こすタスクの最大数。起こした数を返す
+        return ::FutexWake(addr, static_cast<int>(std::min<uint64_t>(arg2, INT32_MAX)));
+    }
+
 #undef SYSCALL
 } // namespace syscall
 
 using SyscallFuncType = int64_t(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType*, 1> syscall_table{
+extern "C" std::array<SyscallFuncType*, 4> syscall_table{
     /* 0x00 */ syscall::LogString,
+    /* 0x01 */ syscall::Exit,
+    /* 0x02 */ syscall::FutexWait,
+    /* 0x03 */ syscall::FutexWake,
 };
 
 void InitializeSyscall() {
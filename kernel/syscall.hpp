@@ -0,0 +1,4 @@
+#pragma once
+
+/** @brief システムコール用の MSR を設定する。CPU ごとに呼ぶ */
+void InitializeSyscall();
\ No newline at end of file
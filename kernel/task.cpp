@@ -18,10 +18,29 @@ namespace
     c.erase(it, c.end());
   }
 
-  void TaskIdle(uint64_t task_id, int64_t data)
+  // タスクの関数から戻るとここに来る。ret で来るのでスタックを揃え直す
+  __attribute__((force_align_arg_pointer)) void TaskReturn()
   {
-    while (true)
-      __asm__("hlt");
+    task_manager->Finish(0);
+  }
+}
+
+void TaskIdle(uint64_t task_id, int64_t data)
+{
+  // タイマは必要なときしか割り込まないので、割り込みで起床したタスクには自分から譲る。
+  // 確認から hlt までの間に起床されないよう割り込みを禁止する（sti の直後の命令までは割り込まれない）
+  while (true)
+  {
+    __asm__("cli");
+    if (task_manager->NumRunnable() > 0)
+    {
+      task_manager->Yield();
+      __asm__("sti");
+      continue;
+    }
+    // 他の CPU から盗めたタスクは、届いたときに IPI で起こされる
+    task_manager->Steal();
+    __asm__("sti\n\thlt");
   }
 }
 
@@ -39,6 +58,7 @@ Task &Task::InitContext(TaskFunc *f, int64_t data)
   context_.cs = kKernelCS;
   context_.ss = kKernelSS;
   context_.rsp = (stack_end & ~0xflu) - 8;
+  *reinterpret_cast<uint64_t *>(context_.rsp) = reinterpret_cast<uint64_t>(TaskReturn);
   context_.rip = reinterpret_cast<uint64_t>(f);
   context_.rdi = id_;
   context_.rsi = data;
@@ -72,12 +92,16 @@ Task& Task::Wakeup()
 
 void Task::SendMessage(const Message& msg)
 {
-  msgs_.push_back(msg);
+  {
+    IRQSaveLockGuard guard{msgs_lock_};
+    msgs_.push_back(msg);
+  }
   Wakeup();
 }
 
 std::optional<Message> Task::ReceiveMessage()
 {
+  IRQSaveLockGuard guard{msgs_lock_};
   if (msgs_.empty())
   {
     return std::nullopt;
@@ -85,6 +109,50 @@ std::optional<Message> Task::ReceiveMessage()
 
   auto m = msgs_.front();
   msgs_.pop_front();
+  ++stats_.msgs_received;
+  return m;
+}
+
+std::optional<Message> Task::ReceiveMessage(Message::Type type)
+{
+  IRQSaveLockGuard guard{msgs_lock_};
+  auto it = std::find_if(msgs_.begin(), msgs_.end(),
+    [type](const Message& m){ return m.type == type; });
+  if (it == msgs_.end())
+  {
+    return std::nullopt;
+  }
+
+  auto m = *it;
+  msgs_.erase(it);
+  ++stats_.msgs_received;
+  return m;
+}
+
+std::optional<Message> Task::WaitMessage(unsigned long timeout)
+{
+  std::optional<TimerHandle> timer;
+  std::optional<Message> m;
+  // 確認してから Sleep するまでに届いたメッセージは wakeup_pending_ で拾える
+  while (!(m = ReceiveMessage()) && timer_manager->CurrentTick() < timeout)
+  {
+    if (!timer && timeout != std::numeric_limits<unsigned long>::max())
+    {
+      auto [handle, err] = timer_manager->AddTimer(Timer{timeout, kWakeupTimerValue, id_});
+      if (err)
+      {
+        break;
+      }
+      timer = handle;
+    }
+    Sleep();
+  }
+
+  if (timer)
+  {
+    // 期限前に起きた場合は取り消す（既に発火していれば何もしない）
+    timer_manager->CancelTimer(*timer);
+  }
   return m;
 }
 
@@ -98,201 +166,1195 @@ bool Task::Running() const
   return running_;
 }
 
+uint32_t Task::Affinity() const
+{
+  return affinity_;
+}
+
+uint64_t &Task::OSStackPointer()
+{
+  return os_stack_ptr_;
+}
+
 TaskManager::TaskManager()
 {
+  auto &rq = run_queues_[0];
   Task& task = NewTask()
-    .SetLevel(current_level_)
+    .SetLevel(rq.current_level)
     .SetRunning(true);
-  running_[current_level_].push_back(&task);
+  task.switched_in_tsc_ = ReadTimebase();
+  rq.running[rq.current_level].push_back(&task);
 
   Task& idle = NewTask()
     .InitContext(TaskIdle, 0)
     .SetLevel(0)
     .SetRunning(true);
-  running_[0].push_back(&idle);
+  rq.running[0].push_back(&idle);
+  idle_tasks_[0] = &idle;
 }
 
 Task &TaskManager::NewTask()
 {
+  IRQSaveLockGuard guard{lock_};
   ++latest_id_;
-  return *tasks_.emplace_back(new Task{latest_id_});
+  Task &task = *tasks_.emplace_back(new Task{latest_id_});
+  task.cpu_ = next_cpu_;
+  next_cpu_ = (next_cpu_ + 1) % num_cpus;
+  return task;
+}
+
+Task &TaskManager::InitializeCPU(int cpu)
+{
+  Task &idle = NewTask();
+  IRQSaveLockGuard guard{lock_};
+  idle.SetLevel(0).SetRunning(true);
+  idle.cpu_ = cpu;
+  idle.switched_in_tsc_ = ReadTimebase();
+  auto &rq = run_queues_[cpu];
+  rq.running[0].push_back(&idle);
+  rq.current_level = 0;
+  idle_tasks_[cpu] = &idle;
+  return idle;
+}
+
+void TaskManager::UpdateCurrentLevel(RunQueue &rq)
+{
+  if (!rq.level_changed)
+  {
+    return;
+  }
+
+  rq.level_changed = false;
+  for (int lv = kRealTimeLevel; lv >= 0; --lv)
+  {
+    if (!rq.running[lv].empty())
+    {
+      rq.current_level = lv;
+      break;
+    }
+  }
 }
 
-Task *TaskManager::RotateCurrentRunQueue(bool current_sleep)
+Task *TaskManager::RotateCurrentRunQueue(int cpu, bool current_sleep)
 {
-  auto &level_queue = running_[current_level_];
+  auto &rq = run_queues_[cpu];
+  ReapDeadTask(rq);
+  auto &level_queue = rq.running[rq.current_level];
   Task *current_task = level_queue.front();
   level_queue.pop_front();
-  if (!current_sleep)
+  // 他の CPU から Sleep されていたらここで外す
+  if (!current_sleep && current_task->Running())
   {
-    level_queue.push_back(current_task);
+    PushRunQueue(cpu, current_task, nullptr);
   }
   if (level_queue.empty())
   {
-    level_changed_ = true;
+    rq.level_changed = true;
   }
+  UpdateCurrentLevel(rq);
+  ForwardMigrations(cpu, current_task);
+
+  return current_task;
+}
 
-  if (level_changed_)
+void TaskManager::SetMigrateTo(Task *task, int cpu)
+{
+  if (task->migrate_to_ >= 0)
+  {
+    --run_queues_[task->migrate_to_].incoming;
+  }
+
+  task->migrate_to_ = cpu == task->cpu_ ? -1 : cpu;
+  if (task->migrate_to_ >= 0)
   {
-    level_changed_ = false;
-    for (int lv = kMaxLevel; lv >= 0; --lv)
+    ++run_queues_[cpu].incoming;
+    run_queues_[task->cpu_].migrations_pending = true;
+  }
+}
+
+void TaskManager::ForwardMigrations(int cpu, Task *current_task)
+{
+  auto &rq = run_queues_[cpu];
+  if (!rq.migrations_pending)
+  {
+    return;
+  }
+
+  rq.migrations_pending = false;
+  for (auto &level_queue : rq.running)
+  {
+    for (auto it = level_queue.begin(); it != level_queue.end();)
     {
-      if (!running_[lv].empty())
+      Task *task = *it;
+      const int dst = task->migrate_to_;
+      if (dst < 0)
       {
-        current_level_ = lv;
-        break;
+        ++it;
+        continue;
       }
+      if (task == current_task)
+      {
+        // 切り替え元のタスクはまだこの CPU がスタックを使っているので、次の切り替えで渡す
+        rq.migrations_pending = true;
+        ++it;
+        continue;
+      }
+
+      it = level_queue.erase(it);
+      SetMigrateTo(task, task->cpu_);
+      task->cpu_ = dst;
+      auto &dst_rq = run_queues_[dst];
+      PushRunQueue(dst, task, RunningTask(dst));
+      if (task->Level() > dst_rq.current_level)
+      {
+        dst_rq.level_changed = true;
+      }
+      rq.level_changed = true;
+      SendIPI(dst, InterruptVector::kReschedule);
     }
   }
+  UpdateCurrentLevel(rq);
+}
 
-  return current_task;
+Task *TaskManager::PickMigratable(int src, int dst)
+{
+  const Task *running = RunningTask(src);
+  // 末尾ほど最近まで待っていないので、キャッシュに残っている見込みが小さい
+  for (int lv = kMaxLevel; lv >= 0; --lv)
+  {
+    const auto &level_queue = run_queues_[src].running[lv];
+    for (auto it = level_queue.rbegin(); it != level_queue.rend(); ++it)
+    {
+      Task *task = *it;
+      if (task != running && task != idle_tasks_[src] && !task->rt_ &&
+          task->migrate_to_ < 0 && (task->affinity_ >> dst) & 1)
+      {
+        return task;
+      }
+    }
+  }
+  return nullptr;
+}
+
+size_t TaskManager::Load(int cpu) const
+{
+  return CountRunnable(cpu) + run_queues_[cpu].incoming;
+}
+
+bool TaskManager::Steal()
+{
+  IRQSaveLockGuard guard{lock_};
+  const int cpu = CurrentCPU();
+  if (run_queues_[cpu].incoming > 0)
+  {
+    return false; // 頼んだタスクがまだ届いていない
+  }
+
+  int victim = -1;
+  size_t victim_load = 1; // 実行中のタスクしか無い CPU からは盗まない
+  for (int c = 0; c < num_cpus; ++c)
+  {
+    if (c != cpu && Load(c) > victim_load)
+    {
+      victim = c;
+      victim_load = Load(c);
+    }
+  }
+  if (victim < 0)
+  {
+    return false;
+  }
+
+  Task *task = PickMigratable(victim, cpu);
+  if (!task)
+  {
+    return false;
+  }
+  // 移すのは持ち主の CPU が次にタスクを切り替えるとき。届いたら IPI で起こされる
+  SetMigrateTo(task, cpu);
+  return true;
+}
+
+void TaskManager::Rebalance()
+{
+  IRQSaveLockGuard guard{lock_};
+  const int cpu = CurrentCPU();
+  if (++run_queues_[cpu].switches % kRebalanceSwitches != 0)
+  {
+    return;
+  }
+
+  int target = -1;
+  size_t target_load = Load(cpu);
+  for (int c = 0; c < num_cpus; ++c)
+  {
+    if (c != cpu && Load(c) + 1 < target_load)
+    {
+      target = c;
+      target_load = Load(c);
+    }
+  }
+  if (target < 0)
+  {
+    return;
+  }
+
+  if (Task *task = PickMigratable(cpu, target))
+  {
+    SetMigrateTo(task, target);
+  }
+}
+
+Task *TaskManager::RunningTask(int cpu)
+{
+  auto &rq = run_queues_[cpu];
+  auto &level_queue = rq.running[rq.current_level];
+  return level_queue.empty() ? nullptr : level_queue.front();
 }
 
 void TaskManager::SwitchTask(const TaskContext &current_ctx)
 {
-  TaskContext &task_ctx = task_manager->CurrentTask().Context();
+  const int cpu = CurrentCPU();
+  lock_.Lock();
+  TaskContext &task_ctx = RunningTask(cpu)->Context();
   memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
-  Task *current_task = RotateCurrentRunQueue(false);
-  if (&CurrentTask() != current_task)
+  Task *current_task = RotateCurrentRunQueue(cpu, false);
+  Task *next_task = RunningTask(cpu);
+  AccountSwitch(current_task, next_task, false);
+  const uint64_t rt_timeout = RealTimeTimeout(next_task);
+  lock_.Unlock();
+
+  if (rt_timeout)
   {
-    RestoreContext(&CurrentTask().Context());
+    timer_manager->ArmTaskTimerTSC(rt_timeout);
   }
+  if (next_task != current_task)
+  {
+    RestoreContext(&next_task->Context());
+  }
+}
+
+void TaskManager::Yield()
+{
+  IRQSaveLockGuard guard{lock_};
+  const int cpu = CurrentCPU();
+  Task *current_task = RotateCurrentRunQueue(cpu, false);
+  Task *next_task = RunningTask(cpu);
+  AccountSwitch(current_task, next_task, true);
+  const uint64_t rt_timeout = RealTimeTimeout(next_task);
+  guard.Unlock();
+
+  if (rt_timeout)
+  {
+    timer_manager->ArmTaskTimerTSC(rt_timeout);
+  }
+  if (next_task != current_task)
+  {
+    SwitchContext(&next_task->Context(), &current_task->Context());
+  }
+}
 
-  // Task *next_task = running_[current_level_].front();
+size_t TaskManager::NumRunnable() const
+{
+  IRQSaveLockGuard guard{lock_};
+  return CountRunnable(CurrentCPU());
+}
 
-  // SwitchContext(&next_task->Context(), &current_task->Context());
+size_t TaskManager::CountRunnable(int cpu) const
+{
+  size_t n = 0;
+  for (const auto &level_queue : run_queues_[cpu].running)
+  {
+    n += level_queue.size();
+  }
+  return n - 1; // アイドルタスクは常に実行可能
 }
 
 Task& TaskManager::CurrentTask()
 {
-  return *running_[current_level_].front();
+  IRQSaveLockGuard guard{lock_};
+  return *RunningTask(CurrentCPU());
 }
 
-Error TaskManager::SendMessage(uint64_t id, const Message& msg)
+Task* TaskManager::FindTask(uint64_t id)
 {
   auto it = std::find_if(tasks_.begin(), tasks_.end(),
     [id](const auto& t){ return t->ID() == id; });
-  
-  if (it == tasks_.end())
+  return it == tasks_.end() ? nullptr : it->get();
+}
+
+Task* TaskManager::FindTaskRef(uint64_t id)
+{
+  IRQSaveLockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if (task)
   {
-    return MAKE_ERROR(Error::kNoSuchTask);
+    ++task->refs_;
   }
+  return task;
+}
+
+void TaskManager::Unref(Task* task)
+{
+  IRQSaveLockGuard guard{lock_};
+  if (--task->refs_ == 0 && task->reap_pending_)
+  {
+    EraseTask(task);
+  }
+}
+
+void TaskManager::EraseTask(Task* task)
+{
+  // 終了コードは WaitFinish か Detach まで finish_codes_ に残す
+  auto it = std::find_if(tasks_.begin(), tasks_.end(),
+    [task](const auto& t){ return t.get() == task; });
+  tasks_.erase(it);
+}
 
-  (*it)->SendMessage(msg);
+Error TaskManager::SendMessage(uint64_t id, const Message& msg)
+{
+  Task* task;
+  {
+    IRQSaveLockGuard guard{lock_};
+    task = FindTask(id);
+    if (!task)
+    {
+      return MAKE_ERROR(Error::kNoSuchTask);
+    }
+    if (Task* src = FindTask(msg.src_task))
+    {
+      ++src->stats_.msgs_sent;
+    }
+    // ロックを外した後で終了して解放されないよう、使い終えるまで参照を持つ
+    ++task->refs_;
+  }
+
+  task->SendMessage(msg);
+  Unref(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::ChangeLevelRunning(Task* task, int level)
 {
-  if (level < 0 || level == task->Level())
+  // リアルタイムタスクのレベルは変えない
+  if (level < 0 || level == task->Level() || task->rt_)
   {
     return;
   }
 
-  if (task != running_[current_level_].front())
+  auto &rq = run_queues_[task->cpu_];
+  if (task != RunningTask(task->cpu_))
   {
     // change level of other task
-    Erase(running_[task->Level()], task);
-    running_[level].push_back(task);
+    Erase(rq.running[task->Level()], task);
     task->SetLevel(level);
-    if (level > current_level_)
+    PushRunQueue(task->cpu_, task, RunningTask(task->cpu_));
+    if (level > rq.current_level)
     {
-      level_changed_ = true;
+      rq.level_changed = true;
     }
     return;
   }
 
   // change level myself
-  running_[current_level_].pop_front();
-  running_[level].push_front(task);
+  rq.running[rq.current_level].pop_front();
+  rq.running[level].push_front(task);
   task->SetLevel(level);
-  if (level >= current_level_)
+  if (level >= rq.current_level)
   {
-    current_level_ = level;
+    rq.current_level = level;
   } else
   {
-    current_level_ = level;
-    level_changed_ = true;
+    rq.current_level = level;
+    rq.level_changed = true;
   }
 }
 
 void TaskManager::Sleep(Task* task) 
 {
+  IRQSaveLockGuard guard{lock_};
   if (!task->Running())
   {
     return;
   }
 
-  task->SetRunning(false);
-
-  if (task == running_[current_level_].front())
+  const int cpu = CurrentCPU();
+  if (task == RunningTask(cpu))
   {
-    Task *current_task = RotateCurrentRunQueue(true);
-    SwitchContext(&CurrentTask().Context(), &current_task->Context());
+    if (task->wakeup_pending_)
+    {
+      task->wakeup_pending_ = false;
+      return;
+    }
+
+    task->SetRunning(false);
+    SetMigrateTo(task, task->cpu_);
+    Task *current_task = RotateCurrentRunQueue(cpu, true);
+    Task *next_task = RunningTask(cpu);
+    AccountSwitch(current_task, next_task, true);
+    const uint64_t rt_timeout = RealTimeTimeout(next_task);
+    // ロックだけ外し、割り込みは切り替え先で元に戻るまで禁止のままにする
+    guard.Unlock();
+    if (rt_timeout)
+    {
+      timer_manager->ArmTaskTimerTSC(rt_timeout);
+    }
+    SwitchContext(&next_task->Context(), &current_task->Context());
     return;
   }
 
-  Erase(running_[task->Level()], task);
+  task->SetRunning(false);
+  // 移す印は取り消す（スリープ中は移せないので、移り先の負荷に数えたままにしない）
+  SetMigrateTo(task, task->cpu_);
+  if (const int task_cpu = task->cpu_; task == RunningTask(task_cpu))
+  {
+    // 他の CPU で実行中。その CPU が次に切り替えるときにキューから外す。
+    // タスク切り替えの期限が無いとそのまま走り続けるので、IPI ですぐに切り替えさせる
+    guard.Unlock();
+    SendIPI(task_cpu, InterruptVector::kReschedule);
+    return;
+  }
+  Erase(run_queues_[task->cpu_].running[task->Level()], task);
 }
 
 Error TaskManager::Sleep(uint64_t id)
 {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-    [id](const auto& t){ return t->ID() == id; });
-  
-  if (it == tasks_.end())
+  Task* task = FindTaskRef(id);
+  if (!task)
   {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Sleep(it->get());
+  Sleep(task);
+  Unref(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level)
 {
+  IRQSaveLockGuard guard{lock_};
+  if (task->finished_)
+  {
+    return;
+  }
+  if (task->rt_throttled_)
+  {
+    // 予算を使い切ったリアルタイムタスクは締め切りまで起こさない（その時刻にタイマで起こす）
+    if (timer_manager->CurrentTick() < task->rt_deadline_)
+    {
+      return;
+    }
+    task->rt_throttled_ = false;
+  }
+
+  const int cpu = task->cpu_;
+  if (!task->Running() && task == RunningTask(cpu))
+  {
+    // 他の CPU から Sleep されたが、まだキューから外れていない
+    task->SetRunning(true);
+  }
+
   if (task->Running())
   {
+    task->wakeup_pending_ = true;
     ChangeLevelRunning(task, level);
     return;
   }
 
-  if (level < 0)
+  if (level < 0 || task->rt_)
   {
     level = task->Level();
   }
+  if (task->rt_)
+  {
+    ReleaseRealTime(task);
+  }
 
   task->SetLevel(level);
   task->SetRunning(true);
+  task->wakeup_pending_ = false;
+  task->wakeup_tsc_ = ReadTimebase();
 
-  running_[level].push_back(task);
-  if (level > current_level_)
+  auto &rq = run_queues_[cpu];
+  PushRunQueue(cpu, task, RunningTask(cpu));
+  if (level > rq.current_level)
+  {
+    rq.level_changed = true;
+  }
+  if (((task->affinity_ >> cpu) & 1) == 0)
   {
-    level_changed_ = true;
+    SetMigrateTo(task, __builtin_ctz(task->affinity_));
   }
 
-  return;
+  const bool arm_task_timer = CountRunnable(cpu) > 1;
+  const bool preempt = task->rt_ && PreemptionPending(cpu);
+  // タイマのロックを取る前に外す（TimerManager は自分のロックを持ったまま Wakeup を呼ばない）
+  guard.Unlock();
+  if (cpu != CurrentCPU())
+  {
+    // 移り先の CPU が hlt していれば起こし、そこでタスク切り替えの期限を設定させる
+    SendIPI(cpu, InterruptVector::kReschedule);
+  }
+  else if (preempt)
+  {
+    // 今の tick を期限にすると、すぐにタイマ割り込みが来て切り替わる
+    timer_manager->ArmTaskTimer(timer_manager->CurrentTick());
+  }
+  else if (arm_task_timer)
+  {
+    timer_manager->ArmTaskTimer();
+  }
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-  auto it = std::find_if(tasks_.begin(), tasks_.end(),
-    [id](const auto& t){ return t->ID() == id; });
+  Task* task = FindTaskRef(id);
+  if (!task)
+  {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  Wakeup(task, level);
+  Unref(task);
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-  if (it == tasks_.end())
+Error TaskManager::Migrate(uint64_t id, int cpu)
+{
+  if (cpu < 0 || cpu >= num_cpus)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  IRQSaveLockGuard guard{lock_};
+  Task* task = FindTask(id);
+  // アイドルタスクは自分の CPU から動かせない
+  if (!task || task->finished_ || task == idle_tasks_[task->cpu_])
   {
     return MAKE_ERROR(Error::kNoSuchTask);
   }
+  if (((task->affinity_ >> cpu) & 1) == 0)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
 
-  Wakeup(it->get(), level);
+  SetMigrateTo(task, cpu);
   return MAKE_ERROR(Error::kSuccess);
 }
 
+WithError<Message> TaskManager::Call(uint64_t id, const Message& msg, Message::Type reply_type)
+{
+  Task& caller = CurrentTask();
+  Task* server;
+  {
+    IRQSaveLockGuard guard{lock_};
+    server = FindTask(id);
+    if (!server || server->finished_)
+    {
+      return {msg, MAKE_ERROR(Error::kNoSuchTask)};
+    }
+
+    server->pending_callers_.push_back(caller.ID());
+    // 失敗したときに引き上げを戻せるよう、送り終えるまで参照を持つ
+    ++server->refs_;
+    // リアルタイムのレベルには上げない
+    const int level = std::min(caller.Level(), kMaxLevel);
+    if (level > server->Level())
+    {
+      if (server->base_level_ < 0)
+      {
+        server->base_level_ = server->Level();
+      }
+      if (server->Running())
+      {
+        ChangeLevelRunning(server, level);
+      }
+      else
+      {
+        server->SetLevel(level); // 起床するときにこのレベルで実行キューへ入る
+      }
+    }
+  }
+
+  if (auto err = SendMessage(id, msg))
+  {
+    // 返信は来ないので、Reply の代わりに数と引き上げを戻す
+    {
+      IRQSaveLockGuard guard{lock_};
+      EndCall(server, caller.ID());
+    }
+    Unref(server);
+    return {msg, err};
+  }
+  Unref(server);
+
+  std::optional<Message> reply;
+  // 返信が届いてから Sleep するまでの Wakeup は wakeup_pending_ で拾える
+  while (!(reply = caller.ReceiveMessage(reply_type)))
+  {
+    caller.Sleep();
+  }
+  return {*reply, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error TaskManager::Reply(uint64_t id, const Message& msg)
+{
+  Task& server = CurrentTask();
+  Message reply = msg;
+  reply.src_task = server.ID();
+  // 引き上げられたレベルのまま返信し終えてから元に戻す
+  const auto err = SendMessage(id, reply);
+
+  // Call ではなく SendMessage で届いたメッセージへの返信なら、引き上げはそのまま
+  IRQSaveLockGuard guard{lock_};
+  EndCall(&server, id);
+  return err;
+}
+
+void TaskManager::EndCall(Task* server, uint64_t caller_id)
+{
+  auto& callers = server->pending_callers_;
+  auto it = std::find(callers.begin(), callers.end(), caller_id);
+  if (it == callers.end())
+  {
+    return;
+  }
+  callers.erase(it);
+  if (callers.empty() && server->base_level_ >= 0)
+  {
+    if (server->Running())
+    {
+      ChangeLevelRunning(server, server->base_level_);
+    }
+    else
+    {
+      server->SetLevel(server->base_level_);
+    }
+    server->base_level_ = -1;
+  }
+}
+
+void TaskManager::Finish(int exit_code)
+{
+  // 待っているタスクを先に起こす。起きたタスクは終了コードを見つけて戻る
+  WaitQueue waiters;
+  {
+    IRQSaveLockGuard guard{lock_};
+    Task *current_task = RunningTask(CurrentCPU());
+    current_task->finishing_ = true;
+    if (!current_task->detached_)
+    {
+      finish_codes_[current_task->ID()] = exit_code;
+    }
+    while (Task* waiter = finish_waiters_.Pop(current_task->ID()))
+    {
+      waiters.Push(waiter);
+    }
+  }
+  while (Task* waiter = waiters.Pop())
+  {
+    Wakeup(waiter);
+  }
+
+  IRQSaveLockGuard guard{lock_};
+  const int cpu = CurrentCPU();
+  auto &rq = run_queues_[cpu];
+  Task *current_task = RunningTask(cpu);
+  current_task->finished_ = true;
+  current_task->SetRunning(false);
+  SetMigrateTo(current_task, current_task->cpu_);
+  RotateCurrentRunQueue(cpu, true);
+  // ここから切り替え終えるまではまだこのタスクのスタックを使う
+  rq.dead = current_task;
+  Task *next_task = RunningTask(cpu);
+  AccountSwitch(current_task, next_task, true);
+  if (current_task->rt_)
+  {
+    rq.rt_permille -= current_task->rt_permille_;
+  }
+  const uint64_t rt_timeout = RealTimeTimeout(next_task);
+  guard.Unlock();
+  if (rt_timeout)
+  {
+    timer_manager->ArmTaskTimerTSC(rt_timeout);
+  }
+  RestoreContext(&next_task->Context());
+  __builtin_unreachable();
+}
+
+void TaskManager::ReapDeadTask(RunQueue &rq)
+{
+  if (!rq.dead)
+  {
+    return;
+  }
+
+  Task *dead = rq.dead;
+  rq.dead = nullptr;
+  if (dead->refs_ > 0)
+  {
+    // ロックの外でまだ使われている。最後の Unref で解放する
+    dead->reap_pending_ = true;
+    return;
+  }
+  EraseTask(dead);
+}
+
+WithError<int> TaskManager::WaitFinish(uint64_t id)
+{
+  Task* current = &CurrentTask();
+  while (true)
+  {
+    {
+      IRQSaveLockGuard guard{lock_};
+      if (auto it = finish_codes_.find(id); it != finish_codes_.end())
+      {
+        finish_waiters_.Remove(current);
+        const int exit_code = it->second;
+        finish_codes_.erase(it);
+        return {exit_code, MAKE_ERROR(Error::kSuccess)};
+      }
+
+      // 終了していて終了コードが無いのは、Detach されたか他のタスクが受け取った後
+      Task* task = FindTask(id);
+      if (!task || task == current || task->finishing_)
+      {
+        finish_waiters_.Remove(current);
+        return {0, MAKE_ERROR(Error::kNoSuchTask)};
+      }
+      finish_waiters_.Push(current, id);
+    }
+
+    // Finish の Wakeup がここまでに来ていても wakeup_pending_ が残るので取りこぼさない
+    current->Sleep();
+  }
+}
+
+Error TaskManager::Detach(uint64_t id)
+{
+  IRQSaveLockGuard guard{lock_};
+  if (finish_codes_.erase(id) > 0)
+  {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  Task* task = FindTask(id);
+  if (!task || task->finishing_)
+  {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+  task->detached_ = true;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+size_t TaskManager::NumTasks() const
+{
+  IRQSaveLockGuard guard{lock_};
+  return tasks_.size();
+}
+
+void TaskManager::AccountSwitch(Task *current_task, Task *next_task, bool voluntary)
+{
+  if (next_task == current_task)
+  {
+    return;
+  }
+
+  const uint64_t now = ReadTimebase();
+  auto &stats = current_task->stats_;
+  stats.runtime_tsc += now - current_task->switched_in_tsc_;
+  if (current_task->rt_)
+  {
+    current_task->rt_budget_left_tsc_ -= now - current_task->switched_in_tsc_;
+  }
+  ++(voluntary ? stats.voluntary_switches : stats.involuntary_switches);
+
+  next_task->switched_in_tsc_ = now;
+  if (next_task->wakeup_tsc_ != 0)
+  {
+    const uint64_t latency = now - next_task->wakeup_tsc_;
+    next_task->wakeup_tsc_ = 0;
+    auto &next_stats = next_task->stats_;
+    ++next_stats.wakeups;
+    next_stats.total_wakeup_latency_tsc += latency;
+    next_stats.max_wakeup_latency_tsc = std::max(next_stats.max_wakeup_latency_tsc, latency);
+  }
+}
+
+std::vector<TaskInfo> TaskManager::ListTasks() const
+{
+  IRQSaveLockGuard guard{lock_};
+  const uint64_t now = ReadTimebase();
+  std::vector<TaskInfo> infos;
+  infos.reserve(tasks_.size());
+  for (const auto &task : tasks_)
+  {
+    if (task->finished_)
+    {
+      continue;
+    }
+
+    TaskInfo info{task->ID(), task->cpu_, task->Level(), task->Running(), task->stats_};
+    {
+      // msgs_received だけは msgs_lock_ で更新される（ロックの順序は lock_ -> msgs_lock_）
+      LockGuard<SpinLock> msgs_guard{task->msgs_lock_};
+      info.stats.msgs_received = task->stats_.msgs_received;
+    }
+    const auto &rq = run_queues_[task->cpu_];
+    const auto &level_queue = rq.running[rq.current_level];
+    if (!level_queue.empty() && level_queue.front() == task.get())
+    {
+      info.stats.runtime_tsc += now - task->switched_in_tsc_;
+    }
+    infos.push_back(info);
+  }
+  return infos;
+}
+
+Error TaskManager::SetAffinity(uint64_t id, uint32_t cpu_mask)
+{
+  cpu_mask &= (1u << num_cpus) - 1;
+  if (cpu_mask == 0)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  IRQSaveLockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if (!task || task->finished_ || task == idle_tasks_[task->cpu_])
+  {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  if (task->rt_)
+  {
+    return MAKE_ERROR(Error::kInvalidPhase); // リアルタイムタスクは CPU に固定する
+  }
+
+  task->affinity_ = cpu_mask;
+  const int cpu = task->migrate_to_ >= 0 ? task->migrate_to_ : task->cpu_;
+  if (((cpu_mask >> cpu) & 1) == 0)
+  {
+    SetMigrateTo(task, __builtin_ctz(cpu_mask));
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error TaskManager::SetRealTime(uint64_t id, unsigned long period, unsigned long budget)
+{
+  if (period == 0 || budget == 0 || budget > period)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  IRQSaveLockGuard guard{lock_};
+  Task* task = FindTask(id);
+  if (!task || task->finished_ || task == idle_tasks_[task->cpu_])
+  {
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+  // 移動の途中のタスクは CPU が決まらないので受け付けない
+  if (task->rt_ || task->migrate_to_ >= 0)
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  const int cpu = task->cpu_;
+  auto &rq = run_queues_[cpu];
+  const unsigned int permille = budget * 1000 / period;
+  if (rq.rt_permille + permille > kRealTimeMaxPermille)
+  {
+    return MAKE_ERROR(Error::kFull);
+  }
+  rq.rt_permille += permille;
+
+  task->rt_ = true;
+  task->rt_period_ = period;
+  task->rt_budget_ = budget;
+  task->rt_permille_ = permille;
+  task->rt_deadline_ = 0;
+  task->affinity_ = 1u << cpu;
+  ReleaseRealTime(task);
+
+  if (task->Running())
+  {
+    // 実行中なら、次の切り替えでリアルタイムのレベルから実行されるよう入れ直す
+    auto &level_queue = rq.running[task->Level()];
+    if (task == RunningTask(cpu))
+    {
+      level_queue.pop_front();
+      task->SetLevel(kRealTimeLevel);
+      rq.running[kRealTimeLevel].push_front(task);
+      rq.current_level = kRealTimeLevel;
+      rq.level_changed = false;
+    }
+    else
+    {
+      Erase(level_queue, task);
+      task->SetLevel(kRealTimeLevel);
+      PushRunQueue(cpu, task, RunningTask(cpu));
+    }
+    if (level_queue.empty())
+    {
+      rq.level_changed = true;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  task->SetLevel(kRealTimeLevel);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+std::pair<uint64_t, unsigned long> TaskManager::ThrottleRealTime()
+{
+  IRQSaveLockGuard guard{lock_};
+  Task *task = RunningTask(CurrentCPU());
+  if (!task->rt_)
+  {
+    return {0, 0};
+  }
+
+  // ここまでの実行時間を予算から引いておく
+  const uint64_t now = ReadTimebase();
+  task->stats_.runtime_tsc += now - task->switched_in_tsc_;
+  task->rt_budget_left_tsc_ -= now - task->switched_in_tsc_;
+  task->switched_in_tsc_ = now;
+
+  const unsigned long tick = timer_manager->CurrentTick();
+  if (tick >= task->rt_deadline_)
+  {
+    // 締め切りを過ぎた。次の周期として続ける（実行キューの位置は切り替え時に直る）
+    ++task->stats_.rt_deadline_misses;
+    ReleaseRealTime(task);
+    return {0, 0};
+  }
+  if (task->rt_budget_left_tsc_ > 0)
+  {
+    return {0, 0};
+  }
+
+  // 予算を使い切った。締め切りまで止める（切り替え時に実行キューから外れる）
+  ++task->stats_.rt_overruns;
+  task->rt_throttled_ = true;
+  task->SetRunning(false);
+  return {task->ID(), task->rt_deadline_};
+}
+
+bool TaskManager::NeedsPreemption()
+{
+  IRQSaveLockGuard guard{lock_};
+  const int cpu = CurrentCPU();
+  // 実行中のタスクが他の CPU から Sleep された場合も、すぐに切り替える
+  return !RunningTask(cpu)->Running() || PreemptionPending(cpu);
+}
+
+void TaskManager::PushRunQueue(int cpu, Task *task, const Task *running)
+{
+  auto &level_queue = run_queues_[cpu].running[task->Level()];
+  if (!task->rt_)
+  {
+    level_queue.push_back(task);
+    return;
+  }
+
+  // 締め切りの早い順に並べる。ただし実行中のタスクの前には入れない
+  auto it = level_queue.begin();
+  if (it != level_queue.end() && *it == running)
+  {
+    ++it;
+  }
+  while (it != level_queue.end() && (*it)->rt_deadline_ <= task->rt_deadline_)
+  {
+    ++it;
+  }
+  level_queue.insert(it, task);
+}
+
+void TaskManager::ReleaseRealTime(Task *task)
+{
+  // 前の締め切りを過ぎていれば新しい周期を始める。過ぎていなければ残りの予算で続ける
+  const unsigned long tick = timer_manager->CurrentTick();
+  if (tick >= task->rt_deadline_)
+  {
+    task->rt_deadline_ = tick + task->rt_period_;
+    task->rt_budget_left_tsc_ = task->rt_budget_ * timer_manager->TSCPerTick();
+  }
+}
+
+uint64_t TaskManager::RealTimeTimeout(const Task *task) const
+{
+  if (!task->rt_)
+  {
+    return 0;
+  }
+
+  // 予算を使い切る時刻か締め切りのどちらか早い方で切り替えを起こす。tick に丸めず TSC で指定する
+  const uint64_t budget_end = ReadTimebase() + std::max<int64_t>(task->rt_budget_left_tsc_, 0);
+  return std::min(budget_end, timer_manager->TSCAt(task->rt_deadline_));
+}
+
+bool TaskManager::PreemptionPending(int cpu)
+{
+  auto &rq = run_queues_[cpu];
+  const auto &rt_queue = rq.running[kRealTimeLevel];
+  if (rt_queue.empty())
+  {
+    return false;
+  }
+  if (rq.current_level < kRealTimeLevel)
+  {
+    return true;
+  }
+  // 実行中のリアルタイムタスクより締め切りの早いタスクが後ろに入った
+  return rt_queue.size() > 1 && rt_queue[1]->rt_deadline_ < rt_queue[0]->rt_deadline_;
+}
+
+void WaitQueue::Push(Task* task, uintptr_t key)
+{
+  if (task->waiting_)
+  {
+    return;
+  }
+
+  task->waiting_ = true;
+  task->wait_key_ = key;
+  task->wait_next_ = nullptr;
+  if (tail_)
+  {
+    tail_->wait_next_ = task;
+  }
+  else
+  {
+    head_ = task;
+  }
+  tail_ = task;
+}
+
+Task* WaitQueue::Pop()
+{
+  Task* task = head_;
+  if (!task)
+  {
+    return nullptr;
+  }
+
+  head_ = task->wait_next_;
+  if (!head_)
+  {
+    tail_ = nullptr;
+  }
+  task->wait_next_ = nullptr;
+  task->waiting_ = false;
+  return task;
+}
+
+Task* WaitQueue::Pop(uintptr_t key)
+{
+  for (Task* t = head_; t; t = t->wait_next_)
+  {
+    if (t->wait_key_ == key)
+    {
+      Remove(t);
+      return t;
+    }
+  }
+  return nullptr;
+}
+
+bool WaitQueue::Remove(Task* task)
+{
+  if (!task->waiting_)
+  {
+    return false;
+  }
+
+  Task* prev = nullptr;
+  for (Task* t = head_; t; prev = t, t = t->wait_next_)
+  {
+    if (t != task)
+    {
+      continue;
+    }
+
+    (prev ? prev->wait_next_ : head_) = t->wait_next_;
+    if (tail_ == t)
+    {
+      tail_ = prev;
+    }
+    t->wait_next_ = nullptr;
+    t->waiting_ = false;
+    return true;
+  }
+  return false;
+}
+
+bool WaitQueue::Contains(const Task* task) const
+{
+  for (const Task* t = head_; t; t = t->wait_next_)
+  {
+    if (t == task)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Mutex::Lock()
+{
+  Task* current = &task_manager->CurrentTask();
+  bool contended = false;
+  while (true)
+  {
+    {
+      IRQSaveLockGuard guard{lock_};
+      if (owner_ == nullptr)
+      {
+        // 別の理由で起こされて先に取れた場合は、並んだままにしない
+        waiters_.Remove(current);
+        owner_ = current;
+        contended_ = contended;
+        acquired_tsc_ = ReadTSC();
+        return;
+      }
+      waiters_.Push(current);
+    }
+
+    contended = true;
+    // Unlock の Wakeup がここまでに来ていても wakeup_pending_ が残るので取りこぼさない
+    current->Sleep();
+  }
+}
+
+bool Mutex::TryLock()
+{
+  Task* current = &task_manager->CurrentTask();
+  IRQSaveLockGuard guard{lock_};
+  if (owner_ != nullptr)
+  {
+    return false;
+  }
+
+  owner_ = current;
+  contended_ = false;
+  acquired_tsc_ = ReadTSC();
+  return true;
+}
+
+void Mutex::Unlock()
+{
+  Task* next;
+  {
+    IRQSaveLockGuard guard{lock_};
+    stats_.Record(ReadTSC() - acquired_tsc_, contended_);
+    owner_ = nullptr;
+    next = waiters_.Pop();
+  }
+
+  if (next)
+  {
+    next->Wakeup();
+  }
+}
+
 void InitializeTask() {
   task_manager = new TaskManager;
-
-  __asm__("cli");
-  timer_manager->AddTimer(
-    Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue}
-  );
-  __asm__("sti");
 }
\ No newline at end of file
@@ -4,10 +4,14 @@
 #include <vector>
 #include <memory>
 #include <deque>
+#include <limits>
+#include <map>
 #include <optional>
 
 #include "error.hpp"
 #include "interrupt.hpp"
+#include "lock.hpp"
+#include "smp.hpp"
 
 struct TaskContext
 {
@@ -21,10 +25,39 @@ struct TaskContext
 alignas(16) extern TaskContext task_b_ctx, task_a_ctx;
 
 const int kDefaultLevel = 2;
+// CPU 番号をビットで表した、どの CPU でも実行してよいことを表す CPU マスク
+const uint32_t kAnyCPU = (1u << kMaxCPUs) - 1;
 using TaskFunc = void(uint64_t, int64_t);
 
 extern class TaskManager;
 
+/** @brief タスクごとの実行の統計。時間は TSC のカウント */
+struct TaskStats
+{
+  uint64_t runtime_tsc;
+  uint64_t voluntary_switches;   // Sleep や Yield で自分から譲った回数
+  uint64_t involuntary_switches; // タイマで切り替えられた回数
+  // 起床してから実際に実行されるまでの時間
+  uint64_t wakeups;
+  uint64_t total_wakeup_latency_tsc;
+  uint64_t max_wakeup_latency_tsc;
+  uint64_t msgs_sent;     // src_task としてこのタスクから送られたメッセージ
+  uint64_t msgs_received; // ReceiveMessage で受け取ったメッセージ
+  // リアルタイムタスクが予算を使い切って止められた回数と、締め切りまでに終わらなかった回数
+  uint64_t rt_overruns;
+  uint64_t rt_deadline_misses;
+};
+
+/** @brief TaskManager::ListTasks が返すタスクの情報 */
+struct TaskInfo
+{
+  uint64_t id;
+  int cpu;
+  int level;
+  bool running;
+  TaskStats stats;
+};
+
 class Task
 {
 public:
@@ -35,19 +68,74 @@ public:
   uint64_t ID() const;
   int Level() const;
   bool Running() const;
+  uint32_t Affinity() const;
   Task &Sleep();
   Task &Wakeup();
   std::optional<Message> ReceiveMessage();
+  /** @brief type のメッセージのうち最も古いものを取り出す。他のメッセージは順番のまま残す */
+  std::optional<Message> ReceiveMessage(Message::Type type);
+  /** @brief メッセージが届くか、tick が timeout に達するまでスリープして待つ。
+   *
+   * タイムアウトしたら std::nullopt を返す。
+   */
+  std::optional<Message> WaitMessage(
+      unsigned long timeout = std::numeric_limits<unsigned long>::max());
   void SendMessage(const Message &msg);
+  /** @brief アプリを呼び出したときのカーネルのスタックポインタの保存先。ExitApp で戻るのに使う */
+  uint64_t &OSStackPointer();
 
 private:
   uint64_t id_;
   std::vector<uint64_t> stack_;
   alignas(16) TaskContext context_;
+  SpinLock msgs_lock_;
   std::deque<Message> msgs_;
+  uint64_t os_stack_ptr_{0};
 
+  // msgs_received は msgs_lock_ で、それ以外は TaskManager の lock_ で保護する。
+  // 両方取るときは lock_ を先に取る（msgs_lock_ を持ったまま lock_ は取らない）
+  TaskStats stats_{};
+  // 最後に実行し始めた時刻と、起床してまだ実行されていなければ起床した時刻 (0: なし)。どちらも ReadTimebase の値
+  uint64_t switched_in_tsc_{0};
+  uint64_t wakeup_tsc_{0};
+
+  // 以下は TaskManager の lock_ で保護する
   unsigned int level_{kDefaultLevel};
   bool running_{false};
+  // 属する実行キューの CPU。変えるのはその CPU だけで、他からは migrate_to_ で頼む
+  int cpu_{0};
+  int migrate_to_{-1};
+  // 実行してよい CPU のマスク。負荷分散はこの中でだけタスクを動かす
+  uint32_t affinity_{kAnyCPU};
+  // 実行中に Wakeup されたら立て、次の Sleep はスリープせずに戻る。
+  // 条件を確かめてから Sleep するまでの間の Wakeup を取りこぼさないため
+  bool wakeup_pending_{false};
+  // Finish したタスク。もう実行キューには入らない
+  bool finished_{false};
+  // Finish を呼び、終了コードを残した（finished_ より先に立つ）
+  bool finishing_{false};
+  // Detach された。終了コードを残さずに終わる
+  bool detached_{false};
+  // FindTaskRef で得てロックの外で使っている数と、それが残っていて回収を待っているか
+  int refs_{0};
+  bool reap_pending_{false};
+  // Call で引き上げられる前のレベル (-1: 引き上げられていない) と、まだ Reply していない Call の呼び出し元
+  int base_level_{-1};
+  std::vector<uint64_t> pending_callers_{};
+
+  // リアルタイムクラスのパラメータ（周期と予算は tick）と、今の周期の締め切り (tick) と残りの予算
+  bool rt_{false};
+  bool rt_throttled_{false};
+  unsigned long rt_period_{0};
+  unsigned long rt_budget_{0};
+  unsigned long rt_deadline_{0};
+  int64_t rt_budget_left_tsc_{0};
+  unsigned int rt_permille_{0};
+
+  // WaitQueue のリンク。所属する待ち行列のロックで保護する
+  Task *wait_next_{nullptr};
+  bool waiting_{false};
+  uintptr_t wait_key_{0}; // 行列の中で待っているものを区別する値（futex のアドレス）
 
   Task &SetLevel(int level)
   {
@@ -61,37 +149,218 @@ private:
   }
 
   friend TaskManager;
+  friend class WaitQueue;
+};
+
+/** @brief スリープ中のタスクの待ち行列。
+ *
+ * Task どうしを直接つなぐのでメモリを確保しない。タスクが並べるのは一度に 1 つの行列だけ。
+ * 排他は使う側のロックで行う。
+ */
+class WaitQueue
+{
+public:
+  /** @brief 末尾に並べる。既に並んでいれば何もしない */
+  void Push(Task *task, uintptr_t key = 0);
+  /** @brief 先頭を取り出す。空なら nullptr */
+  Task *Pop();
+  /** @brief key で並んだうち先頭のものを取り出す。無ければ nullptr */
+  Task *Pop(uintptr_t key);
+  /** @brief 並んでいれば取り除いて true を返す */
+  bool Remove(Task *task);
+  bool Contains(const Task *task) const;
+  bool Empty() const { return head_ == nullptr; }
+
+private:
+  Task *head_{nullptr};
+  Task *tail_{nullptr};
 };
 
+/** @brief タスクを管理する。
+ *
+ * 実行キューは CPU ごとにあり、各 CPU は自分のキューのタスクだけを実行する。
+ * 新しいタスクは CPU に順番に割り当てる。別の CPU へ移すときは移り先を記録しておき、
+ * 元の CPU が次にタスクを切り替えるときに移り先のキューへ渡す
+ * （切り替え途中でコンテキストを保存し終えていないタスクを他の CPU が実行しないため）。
+ *
+ * 負荷分散はこの仕組みで行う。実行するタスクが無くなった CPU は一番混んでいる CPU から
+ * タスクを 1 つ盗むよう頼み（Steal）、混んでいる CPU はタスク切り替えの kRebalanceSwitches 回に
+ * 1 回、空いている CPU へタスクを押し出す（Rebalance）。盗むのはキューの末尾から。
+ */
 class TaskManager
 {
 public:
   // level: 0 = lowest, kMaxLevel = highest
   static const int kMaxLevel = 3;
+  // リアルタイムタスクのレベル。通常のタスクより常に先に実行し、この中では締め切りの早い順
+  static const int kRealTimeLevel = kMaxLevel + 1;
+  // 1 つの CPU のリアルタイムタスクの使用率（予算 / 周期）の合計の上限 (‰)
+  static const unsigned int kRealTimeMaxPermille = 900;
+  static const int kRebalanceSwitches = 5;
 
   TaskManager();
   Task &NewTask();
+  /** @brief 呼び出し元を cpu のアイドルタスクとして登録する。AP の起動処理から割り込み禁止で呼ぶ */
+  Task &InitializeCPU(int cpu);
+  /** @brief タイマ割り込みからタスクを切り替える。割り込み禁止で呼ぶ */
   void SwitchTask(const TaskContext &current_ctx);
 
   Task &CurrentTask();
-  Task *RotateCurrentRunQueue(bool current_sleep);
+  void Yield();
+  // この CPU の、アイドルタスクを除いた実行可能なタスクの数
+  size_t NumRunnable() const;
   Error SendMessage(uint64_t id, const Message &msg);
 
+  /** @brief task をスリープさせる。他の CPU で実行中なら、その CPU が次に切り替えるときに外れる */
   void Sleep(Task *task);
   Error Sleep(uint64_t id);
   void Wakeup(Task *task, int level = -1);
   Error Wakeup(uint64_t id, int level = -1);
+  /** @brief タスクを cpu の実行キューへ移す。
+   *
+   * 実際に移るのは元の CPU が次にタスクを切り替えるとき。それまでにスリープしたら取り消される。
+   */
+  Error Migrate(uint64_t id, int cpu);
+  /** @brief タスクをリアルタイムクラスにする（期限駆動 EDF）。
+   *
+   * 起床したとき前の締め切りを過ぎていれば、締め切りを period 後に置き予算を budget に戻す。
+   * 予算を使い切ると締め切りまで実行しない。周期と予算の単位は tick。
+   * タスクは今の CPU に固定され、その CPU の使用率の合計が上限を超えるなら kFull を返す。
+   */
+  Error SetRealTime(uint64_t id, unsigned long period, unsigned long budget);
+  /** @brief 実行中のリアルタイムタスクが予算を使い切っていれば止める。
+   *
+   * タイマ割り込みでタスクを切り替える直前に呼ぶ。止めたらそのタスクの ID と、
+   * 起こすべき tick を返す（止めなければ ID は 0）。
+   */
+  std::pair<uint64_t, unsigned long> ThrottleRealTime();
+  /** @brief この CPU で、実行中のタスクより先に実行すべきリアルタイムタスクが待っているか、実行中のタスクが他の CPU から Sleep されたか */
+  bool NeedsPreemption();
+
+  /** @brief タスク id へ msg を送り、reply_type のメッセージが返ってくるまで待つ。
+   *
+   * 相手のレベルが呼び出し元より低ければ、Reply するまで呼び出し元のレベルへ引き上げる。
+   * 待っている間に届いた他のメッセージは受信キューに残る。
+   */
+  WithError<Message> Call(uint64_t id, const Message &msg, Message::Type reply_type);
+  /** @brief Call への返信を送る。id の Call に返信して未返信の Call が無くなれば、自分のレベルを元に戻す */
+  Error Reply(uint64_t id, const Message &msg);
+
+  /** @brief 実行中のタスクを終了する。終了コードは Detach されていなければ、WaitFinish で受け取るまで残る。
+   *
+   * タスクの関数から戻ったときは終了コード 0 で呼ばれる。スタックなどの資源は、
+   * この CPU が別のタスクに切り替え終えてから解放する。
+   */
+  [[noreturn]] void Finish(int exit_code);
+  /** @brief タスク id が終了するまでスリープして待ち、終了コードを返す。受け取れるのは 1 回だけ */
+  WithError<int> WaitFinish(uint64_t id);
+  /** @brief タスク id の終了コードを受け取らないことにする。終了済みなら残っている終了コードを捨てる */
+  Error Detach(uint64_t id);
+  // 解放されていないタスクの数（終了して解放待ちのものを含む）
+  size_t NumTasks() const;
+  /** @brief 全タスクの情報と統計の写し。実行中のタスクの実行時間には今の分も含める */
+  std::vector<TaskInfo> ListTasks() const;
+
+  /** @brief タスクを実行してよい CPU を cpu_mask に限る。今の CPU が含まれなければ移す */
+  Error SetAffinity(uint64_t id, uint32_t cpu_mask);
+
+  /** @brief 他の CPU からこの CPU へタスクを 1 つ移すよう頼む。アイドルタスクから割り込み禁止で呼ぶ */
+  bool Steal();
+  /** @brief 負荷が偏っていれば、この CPU のタスクを空いている CPU へ移すよう印を付ける。
+   *
+   * タイマ割り込みでタスクを切り替える直前に呼ぶ。
+   */
+  void Rebalance();
 
 private:
+  struct RunQueue
+  {
+    std::array<std::deque<Task *>, kRealTimeLevel + 1> running{};
+    int current_level{kMaxLevel};
+    bool level_changed{false};
+    // キューに移り先の決まったタスクがあるかもしれない
+    bool migrations_pending{false};
+    // この CPU へ移ってくる途中のタスクの数
+    int incoming{0};
+    unsigned int switches{0};
+    // この CPU で終了したタスク。次に切り替えるときにはもうスタックを使っていないので解放する
+    // （FindTaskRef の参照が残っていれば、最後の Unref で解放する）
+    Task *dead{nullptr};
+    // リアルタイムタスクの使用率の合計 (‰)
+    unsigned int rt_permille{0};
+  };
+
+  // タスクの一覧と実行キュー、各タスクの level_ / running_ / cpu_ を保護する。
+  // 割り込みハンドラからも使うので IRQSaveLockGuard で取る
+  mutable SpinLock lock_{"task_manager"};
   std::vector<std::unique_ptr<Task>> tasks_{};
   uint64_t latest_id_{0};
-  std::array<std::deque<Task *>, kMaxLevel + 1> running_{};
-  int current_level_{kMaxLevel};
-  bool level_changed_{false};
+  std::array<RunQueue, kMaxCPUs> run_queues_{};
+  std::array<Task *, kMaxCPUs> idle_tasks_{};
+  int next_cpu_{0};
+  // WaitFinish も Detach もされていない終了コード
+  std::map<uint64_t, int> finish_codes_{};
+  WaitQueue finish_waiters_{};
+
+  /** @brief id のタスクを探して参照を 1 つ増やす。ロックの外で使い終えたら Unref する。
+   *
+   * 参照が残っている間は、タスクが終了しても回収（解放）しない。
+   */
+  Task *FindTaskRef(uint64_t id);
+  void Unref(Task *task);
 
+  // 以下は lock_ を取った状態で呼ぶ
+  Task *RotateCurrentRunQueue(int cpu, bool current_sleep);
+  Task *RunningTask(int cpu);
+  Task *FindTask(uint64_t id);
+  void EraseTask(Task *task);
+  size_t CountRunnable(int cpu) const;
+  size_t Load(int cpu) const;
+  void SetMigrateTo(Task *task, int cpu);
+  void ForwardMigrations(int cpu, Task *current_task);
+  Task *PickMigratable(int src, int dst);
+  void ReapDeadTask(RunQueue &rq);
+  void AccountSwitch(Task *current_task, Task *next_task, bool voluntary);
+  void PushRunQueue(int cpu, Task *task, const Task *running);
+  void ReleaseRealTime(Task *task);
+  // caller_id が Call していれば pending_callers_ から除き、無くなったら引き上げたレベルを戻す
+  void EndCall(Task *server, uint64_t caller_id);
+  // リアルタイムタスクを切り替える期限 (TSC)。リアルタイムでなければ 0
+  uint64_t RealTimeTimeout(const Task *task) const;
+  bool PreemptionPending(int cpu);
   void ChangeLevelRunning(Task *task, int level);
+  void UpdateCurrentLevel(RunQueue &rq);
 };
 
 extern TaskManager *task_manager;
 
-void InitializeTask();
\ No newline at end of file
+/** @brief 取れるまでスリープして待つミューテックス。
+ *
+ * タスクからのみ使い、割り込みハンドラでは使わない。再帰的には取れない。
+ * 解放されると待っているタスクを 1 つ起こし、起きたタスクはもう一度取りに行く。
+ */
+class Mutex
+{
+public:
+  constexpr Mutex(const char *name = nullptr) : stats_{name} {}
+  Mutex(const Mutex &) = delete;
+  Mutex &operator=(const Mutex &) = delete;
+
+  void Lock();
+  /** @brief 取れなければ待たずに false を返す */
+  bool TryLock();
+  void Unlock();
+  const LockStats &Stats() const { return stats_; }
+
+private:
+  SpinLock lock_; // owner_ と waiters_ を保護する
+  Task *owner_{nullptr};
+  WaitQueue waiters_;
+  bool contended_{false};
+  uint64_t acquired_tsc_{0};
+  LockStats stats_;
+};
+
+void InitializeTask();
+/** @brief アイドルタスクの本体。実行可能なタスクが無ければ hlt で割り込みを待つ */
+void TaskIdle(uint64_t task_id, int64_t data);
\ No newline at end of file
@@ -8,7 +8,13 @@
 #include "paging.hpp"
 #include "asmfunc.h"
 #include "memory_manager.hpp"
+#include "timer.hpp"
+#include "clock.hpp"
+#include "lock.hpp"
+#include "futex.hpp"
+#include <cstdlib>
 #include <cstring>
+#include <malloc.h>
 
 namespace
 {
@@ -221,6 +227,81 @@ namespace
     return SetupPageMap(pml4_table, 4, addr, num_4kpages).error;
   }
 
+  Error SetupClockPage()
+  {
+    // 時刻ページは全アプリで共有するカーネルのページなので、割り当てずに直接マップする
+    LinearAddress4Level addr{kClockPageAddr};
+    auto page_map = reinterpret_cast<PageMapEntry *>(GetCR3());
+    for (int level = 4; level > 1; --level)
+    {
+      auto &entry = page_map[addr.Part(level)];
+      auto [child_map, err] = SetNewPageMapIfNotPresent(entry);
+      if (err)
+      {
+        return err;
+      }
+      entry.bits.writable = 1;
+      entry.bits.user = 1;
+      page_map = child_map;
+    }
+
+    auto &entry = page_map[addr.Part(1)];
+    entry.data = 0;
+    entry.SetPointer(reinterpret_cast<PageMapEntry *>(
+        const_cast<ClockPage *>(&GetClockPage())));
+    entry.bits.present = 1;
+    entry.bits.user = 1; // writable = 0 なのでアプリからは読み出し専用
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  /** @brief 時刻ページの対応付けを外す。CleanPageMaps が時刻ページを解放しないよう先に呼ぶ */
+  void UnmapClockPage()
+  {
+    LinearAddress4Level addr{kClockPageAddr};
+    auto page_map = reinterpret_cast<PageMapEntry *>(GetCR3());
+    for (int level = 4; level > 1; --level)
+    {
+      const auto &entry = page_map[addr.Part(level)];
+      if (!entry.bits.present)
+      {
+        return;
+      }
+      page_map = entry.Pointer();
+    }
+    page_map[addr.Part(1)].data = 0;
+  }
+
+  void TaskSpawnBench(uint64_t task_id, int64_t data)
+  {
+    // 何もせずに戻り、終了コード 0 で終わる
+  }
+
+  // draw を n 回呼び、1 回あたりにかかった時間 (ns) を返す
+  template <class Func>
+  uint64_t MeasureNs(int n, Func draw)
+  {
+    const uint64_t start = ReadTSC();
+    for (int i = 0; i < n; ++i)
+    {
+      draw();
+    }
+    const uint64_t elapsed = ReadTSC() - start;
+    const uint64_t tsc_per_ms = tsc_freq / 1000;
+    if (n <= 0 || tsc_per_ms == 0)
+    {
+      return 0;
+    }
+    return elapsed / n * 1000000 / tsc_per_ms;
+  }
+
+  // data が指す値が 0 のまま起こされるまで待ち、FutexWait の結果を終了コードにする
+  void TaskFutexWaiter(uint64_t task_id, int64_t data)
+  {
+    const auto word = reinterpret_cast<const volatile uint32_t *>(data);
+    const auto err = FutexWait(word, 0, std::numeric_limits<unsigned long>::max());
+    task_manager->Finish(static_cast<int>(err.Cause()));
+  }
+
   Error CopyLoadSegments(Elf64_Ehdr *ehdr)
   {
     auto phdr = GetProgramHeader(ehdr);
@@ -473,7 +554,13 @@ void Terminal::ExecuteLine()
 
   if (strcmp(command, "echo") == 0)
   {
-    if (first_arg)
+    if (first_arg && strcmp(first_arg, "$?") == 0)
+    {
+      char s[16];
+      sprintf(s, "%d", last_exit_code_);
+      Print(s);
+    }
+    else if (first_arg)
     {
       Print(first_arg);
     }
@@ -563,6 +650,265 @@ void Terminal::ExecuteLine()
       DrawCursor(true);
     }
   }
+  else if (strcmp(command, "lockstat") == 0)
+  {
+    char s[96];
+    Print("name           acquired  contended  avg hold  max hold (TSC)\n");
+    for (const LockStats *stats = LockStatsList(); stats; stats = stats->next)
+    {
+      sprintf(s, "%-14s %8lu %10lu %9lu %9lu\n",
+              stats->name, stats->acquisitions, stats->contentions,
+              stats->total_hold_tsc / stats->acquisitions, stats->max_hold_tsc);
+      Print(s);
+    }
+  }
+  else if (strcmp(command, "top") == 0)
+  {
+    Top();
+  }
+  else if (strcmp(command, "futexcheck") == 0)
+  {
+    // 別のタスクを FutexWait で眠らせ、このタスクの FutexWake で起こせるかを確かめる
+    char s[96];
+    // 待つ側が終わるまでこのスタックは残る
+    uint32_t word = 0;
+    const uint64_t id = task_manager->NewTask()
+                            .InitContext(TaskFutexWaiter, reinterpret_cast<int64_t>(&word))
+                            .Wakeup()
+                            .ID();
+    // 相手が待ち行列へ並ぶまでは 0 が返るので、1 秒まで譲りながら起こし直す
+    const unsigned long timeout = timer_manager->CurrentTick() + kTimerFreq;
+    int woken = 0;
+    while ((woken = FutexWake(&word, 1)) == 0 && timer_manager->CurrentTick() < timeout)
+    {
+      task_manager->Yield();
+    }
+    if (woken == 0)
+    {
+      // 起こせなかったときも待ち続けないよう、値を変えてから起こす
+      word = 1;
+      FutexWake(&word, 1);
+    }
+    const auto [exit_code, err] = task_manager->WaitFinish(id);
+    sprintf(s, "woken %d (expected 1), waiter returned %s\n", woken,
+            err ? err.Name() : MAKE_ERROR(static_cast<Error::Code>(exit_code)).Name());
+    Print(s);
+  }
+  else if (strcmp(command, "spawnbench") == 0)
+  {
+    // spawnbench [回数]: タスクを作って終了を待つのを繰り返し、1 回あたりの時間を表示する。
+    // 終了したタスクのメモリが返っているかを、ヒープの使用量とプログラムブレークの増分で見る
+    char s[96];
+    const int n = first_arg ? atoi(first_arg) : 1000;
+    const size_t tasks_before = task_manager->NumTasks();
+    const size_t heap_before = mallinfo().uordblks;
+    const caddr_t break_before = program_break;
+    int failures = 0;
+    const uint64_t per_task_ns = MeasureNs(n, [&] {
+      const uint64_t id = task_manager->NewTask()
+                              .InitContext(TaskSpawnBench, 0)
+                              .Wakeup()
+                              .ID();
+      if (task_manager->WaitFinish(id).error)
+      {
+        ++failures;
+      }
+    });
+    sprintf(s, "%d tasks: %lu ns/task, %d failed, tasks %lu -> %lu\n",
+            n, per_task_ns, failures, tasks_before, task_manager->NumTasks());
+    Print(s);
+    sprintf(s, "heap in use: %+ld bytes, program break: %+ld bytes\n",
+            static_cast<long>(mallinfo().uordblks) - static_cast<long>(heap_before),
+            static_cast<long>(program_break - break_before));
+    Print(s);
+  }
+  else if (strcmp(command, "blitbench") == 0)
+  {
+    // blitbench [回数]: 画面全体とウィンドウ大の領域のコピーの速さを、
+    // バックバッファへのコピーと本物のフレームバッファへのコピーのそれぞれで表示する
+    char s[96];
+    const int n = first_arg ? atoi(first_arg) : 100;
+    const auto screen_size = ScreenSize();
+    const auto format = screen.Config().pixel_format;
+    // 画面大のバッファは 1 度だけ確保して、実行のたびに使い回す
+    static FrameBuffer *src_buf, *dst_buf;
+
+    const Rectangle<int> areas[] = {
+        {{0, 0}, screen_size},
+        {{0, 0}, {kColumns * 8 + 8, kRows * 16 + 28}},
+    };
+    uint64_t mbps[2][2]; // [領域][0: バックバッファ, 1: フレームバッファ]
+    {
+      LockGuard<Mutex> lock{layer_mutex};
+      if (src_buf == nullptr)
+      {
+        src_buf = new FrameBuffer;
+        src_buf->Initialize({nullptr, 0, static_cast<uint32_t>(screen_size.x),
+                             static_cast<uint32_t>(screen_size.y), format});
+        dst_buf = new FrameBuffer;
+        dst_buf->Initialize({nullptr, 0, static_cast<uint32_t>(screen_size.x),
+                             static_cast<uint32_t>(screen_size.y), format});
+      }
+      FrameBuffer &src = *src_buf, &dst = *dst_buf;
+      // 今の画面を元にすれば、フレームバッファへ書き戻しても表示は変わらない
+      src.Copy({0, 0}, screen, {{0, 0}, screen_size});
+      for (int a = 0; a < 2; ++a)
+      {
+        for (int t = 0; t < 2; ++t)
+        {
+          FrameBuffer &target = t == 0 ? dst : screen;
+          const uint64_t copy_ns = MeasureNs(n, [&] {
+            target.Copy(areas[a].pos, src, areas[a]);
+          });
+          const uint64_t bytes =
+              static_cast<uint64_t>(areas[a].size.x) * areas[a].size.y * BytesPerPixel(format);
+          mbps[a][t] = copy_ns > 0 ? bytes * 1000 / copy_ns : 0;
+        }
+      }
+    }
+
+    sprintf(s, "back buffer copy: %s\n", CopySpanName());
+    Print(s);
+    for (int a = 0; a < 2; ++a)
+    {
+      sprintf(s, "%4dx%-4d buffer: %lu MB/s, screen: %lu MB/s\n",
+              areas[a].size.x, areas[a].size.y, mbps[a][0], mbps[a][1]);
+      Print(s);
+    }
+  }
+  else if (strcmp(command, "drawbench") == 0)
+  {
+    // drawbench [回数]: 画面外のバッファへの塗りつぶしと文字の描画について、画素ごとに
+    // 仮想関数を呼ぶ汎用の実装と、画素の形式ごとに特殊化した実装の 1 回あたりの時間を表示する
+    char s[96];
+    const int n = first_arg ? atoi(first_arg) : 100;
+    const auto screen_size = ScreenSize();
+    // 画面大のバッファは 1 度だけ確保して、実行のたびに使い回す
+    static FrameBuffer *buf;
+    {
+      LockGuard<Mutex> lock{layer_mutex};
+      if (buf == nullptr)
+      {
+        buf = new FrameBuffer;
+        buf->Initialize({nullptr, 0, static_cast<uint32_t>(screen_size.x),
+                         static_cast<uint32_t>(screen_size.y), screen.Config().pixel_format});
+      }
+    }
+    auto &writer = buf->Writer();
+    const char *text = "The quick brown fox jumps over the lazy dog 0123456789";
+
+    const uint64_t fill_generic = MeasureNs(n, [&] {
+      writer.PixelWriter::FillRect({0, 0}, screen_size, {0, 0, 0});
+    });
+    const uint64_t fill_format = MeasureNs(n, [&] {
+      writer.FillRect({0, 0}, screen_size, {0, 0, 0});
+    });
+    const uint64_t glyph_generic = MeasureNs(n, [&] {
+      for (int i = 0; text[i]; ++i)
+      {
+        writer.PixelWriter::WriteGlyph({8 * i, 0}, GetFont(text[i]), {255, 255, 255});
+      }
+    });
+    const uint64_t glyph_format = MeasureNs(n, [&] {
+      WriteString(writer, {0, 0}, text, {255, 255, 255});
+    });
+
+    sprintf(s, "fill %dx%d: generic %lu ns, specialized %lu ns\n",
+            screen_size.x, screen_size.y, fill_generic, fill_format);
+    Print(s);
+    sprintf(s, "text %lu chars: generic %lu ns, specialized %lu ns\n",
+            strlen(text), glyph_generic, glyph_format);
+    Print(s);
+  }
+  else if (strcmp(command, "blendbench") == 0)
+  {
+    // blendbench [回数]: 画面大の領域を重ねる 1 回あたりの時間を、そのまま写す場合、
+    // レイヤ全体の不透明度で混ぜる場合、画素ごとの不透明度で混ぜる場合のそれぞれで表示する
+    char s[96];
+    const int n = first_arg ? atoi(first_arg) : 100;
+    const auto screen_size = ScreenSize();
+    const auto format = screen.Config().pixel_format;
+    const int bytes_per_pixel = BytesPerPixel(format);
+    // 画面大のバッファと不透明度の列は 1 度だけ作って、実行のたびに使い回す
+    static FrameBuffer *src, *dst;
+    static uint8_t *alpha;
+    {
+      LockGuard<Mutex> lock{layer_mutex};
+      if (src == nullptr)
+      {
+        src = new FrameBuffer;
+        src->Initialize({nullptr, 0, static_cast<uint32_t>(screen_size.x),
+                         static_cast<uint32_t>(screen_size.y), format});
+        src->Writer().FillRect({0, 0}, screen_size, {0x40, 0x80, 0xc0});
+        dst = new FrameBuffer;
+        dst->Initialize({nullptr, 0, static_cast<uint32_t>(screen_size.x),
+                         static_cast<uint32_t>(screen_size.y), format});
+        // 画素ごとの不透明度は 16 画素ごとに不透明、透明、半透明、不透明と並べる（3/4 が速い経路に乗る）
+        const uint8_t pattern[] = {255, 0, 128, 255};
+        alpha = new uint8_t[screen_size.x];
+        for (int x = 0; x < screen_size.x; ++x)
+        {
+          alpha[x] = pattern[(x / 16) % 4];
+        }
+      }
+    }
+
+    const auto src_config = src->Config();
+    const auto dst_config = dst->Config();
+    const size_t bytes_per_line = static_cast<size_t>(bytes_per_pixel) * src_config.pixels_per_scan_line;
+    auto measure = [&](const uint8_t *a, uint8_t layer_alpha) {
+      return MeasureNs(n, [&] {
+        for (int y = 0; y < screen_size.y; ++y)
+        {
+          BlendSpan(dst_config.frame_buffer + bytes_per_line * y, src_config.frame_buffer + bytes_per_line * y,
+                    a, layer_alpha, screen_size.x, format);
+        }
+      });
+    };
+    const uint64_t copy_ns = measure(nullptr, 255);
+    const uint64_t layer_ns = measure(nullptr, 128);
+    const uint64_t pixel_ns = measure(alpha, 255);
+    const uint64_t both_ns = measure(alpha, 192);
+
+    sprintf(s, "blend %dx%d (%d bytes/pixel)\n", screen_size.x, screen_size.y, bytes_per_pixel);
+    Print(s);
+    sprintf(s, "copy %lu ns, layer alpha %lu ns\n", copy_ns, layer_ns);
+    Print(s);
+    sprintf(s, "pixel alpha %lu ns, pixel x layer alpha %lu ns\n", pixel_ns, both_ns);
+    Print(s);
+  }
+  else if (strcmp(command, "frames") == 0)
+  {
+    // 合成タスクが画面へ写したフレームの数と、それにまとめた描画要求の数
+    char s[96];
+    const auto stats = GetCompositorStats();
+    sprintf(s, "frames: drawn %lu, idle %lu, late %lu\n",
+            stats.frames_drawn, stats.frames_idle, stats.frames_late);
+    Print(s);
+    sprintf(s, "damage requests: %lu (%lu per drawn frame)\n", stats.damage_requests,
+            stats.frames_drawn > 0 ? stats.damage_requests / stats.frames_drawn : 0);
+    Print(s);
+  }
+  else if (strcmp(command, "taskset") == 0)
+  {
+    // taskset <task id> <cpu mask (16 進)>
+    char s[64];
+    char *mask_arg = first_arg ? strchr(first_arg, ' ') : nullptr;
+    if (!mask_arg)
+    {
+      Print("usage: taskset <task id> <cpu mask>\n");
+    }
+    else
+    {
+      const uint64_t task_id = strtoul(first_arg, nullptr, 0);
+      const uint32_t cpu_mask = strtoul(mask_arg + 1, nullptr, 16);
+      if (auto err = task_manager->SetAffinity(task_id, cpu_mask))
+      {
+        sprintf(s, "taskset: %s\n", err.Name());
+        Print(s);
+      }
+    }
+  }
   else if (command[0] != 0)
   {
     auto file_entry = fat::FindFile(command);
@@ -635,18 +981,107 @@ Error Terminal::ExecuteFile(const fat::DirectoryEntry &file_entry, char *command
   {
     return err;
   }
+  if (auto err = SetupClockPage())
+  {
+    return err;
+  }
   auto entry_addr = elf_header->e_entry;
-  CallApp(argc.value, argv, 4 << 3 | 3, 3 << 3 | 3, entry_addr, stack_frame_addr.value + 4096 - 8);
+  Task &task = task_manager->CurrentTask();
+  last_exit_code_ = CallApp(argc.value, argv, 4 << 3 | 3, 3 << 3 | 3, entry_addr,
+                            stack_frame_addr.value + 4096 - 8, &task.OSStackPointer());
 
+  // アプリのセグメントと、引数・スタック・時刻ページのある領域を解放する
   const auto addr_first = GetFirstLoadAddress(elf_header);
   if (auto err = CleanPageMaps(LinearAddress4Level{addr_first}))
   {
     return err;
   }
+  UnmapClockPage();
+  if (stack_frame_addr.parts.pml4 != LinearAddress4Level{addr_first}.parts.pml4)
+  {
+    if (auto err = CleanPageMaps(stack_frame_addr))
+    {
+      return err;
+    }
+  }
 
   return MAKE_ERROR(Error::kSuccess);
 }
 
+void Terminal::Top()
+{
+  Task &task = task_manager->CurrentTask();
+  auto prev = task_manager->ListTasks();
+  uint64_t prev_tsc = ReadTimebase();
+  unsigned long refresh_timeout = timer_manager->CurrentTick() + kTimerFreq;
+
+  while (true)
+  {
+    // キー以外のメッセージでも起きるので、表示し直すのは期限が来たときだけ
+    auto msg = task.WaitMessage(refresh_timeout);
+    if (msg && msg->type == Message::kKeyPush)
+    {
+      break;
+    }
+    if (timer_manager->CurrentTick() < refresh_timeout)
+    {
+      continue;
+    }
+    refresh_timeout += kTimerFreq;
+
+    auto infos = task_manager->ListTasks();
+    const uint64_t now = ReadTimebase();
+    const uint64_t elapsed = std::max<uint64_t>(now - prev_tsc, 1);
+    // 前回からの実行時間で並べる（前回に無かったタスクは全実行時間）
+    auto delta = [&prev](const TaskInfo &info)
+    {
+      for (const auto &p : prev)
+      {
+        if (p.id == info.id)
+        {
+          return info.stats.runtime_tsc - p.stats.runtime_tsc;
+        }
+      }
+      return info.stats.runtime_tsc;
+    };
+    std::vector<std::pair<uint64_t, const TaskInfo *>> rows;
+    for (const auto &info : infos)
+    {
+      rows.emplace_back(delta(info), &info);
+    }
+    std::sort(rows.begin(), rows.end(),
+              [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    FillRectangle(*window_->InnerWriter(), {4, 4}, {8 * kColumns, 16 * kRows}, {0, 0, 0});
+    cursor_ = {0, 0};
+    char s[96];
+    sprintf(s, "tasks: %lu  cpus: %d  (press any key to quit)\n", infos.size(), num_cpus);
+    Print(s);
+    Print("  ID CPU LV S  CPU%  vol.sw  inv.sw lat.us  sent  recv\n");
+    for (size_t i = 0; i < rows.size() && i < kRows - 3; ++i)
+    {
+      const auto &[run, info] = rows[i];
+      const auto &st = info->stats;
+      const uint64_t permille = run * 1000 / elapsed;
+      const uint64_t latency_us =
+          st.wakeups ? st.total_wakeup_latency_tsc / st.wakeups * 1000000 / tsc_freq : 0;
+      sprintf(s, "%4lu %3d %2d %c %3lu.%lu %7lu %7lu %6lu %5lu %5lu\n",
+              info->id, info->cpu, info->level, info->running ? 'R' : 'S',
+              permille / 10, permille % 10, st.voluntary_switches, st.involuntary_switches,
+              latency_us, st.msgs_sent, st.msgs_received);
+      Print(s);
+    }
+
+    prev = std::move(infos);
+    prev_tsc = now;
+    task_manager->Call(1, MakeLayerMessage(task.ID(), LayerID(), LayerOperation::Draw, {}),
+                       Message::kLayerFinish);
+  }
+
+  FillRectangle(*window_->InnerWriter(), {4, 4}, {8 * kColumns, 16 * kRows}, {0, 0, 0});
+  cursor_ = {0, 0};
+}
+
 Rectangle<int> Terminal::HistoryUpDown(int direction)
 {
   if (direction == -1 && cmd_history_index_ >= 0)
@@ -680,38 +1115,40 @@ Rectangle<int> Terminal::HistoryUpDown(int direction)
 
 void TaskTerminal(uint64_t task_id, int64_t data)
 {
-  __asm__("cli");
+  // アプリや時間を測る組み込みコマンドもこのタスクで実行するので、リアルタイムにはしない。
+  // キー入力への応答はレイヤの操作を頼む先のメインタスク（リアルタイム）の側で速くする
   Task &task = task_manager->CurrentTask();
-  Terminal *terminal = new Terminal;
-  layer_manager->Move(terminal->LayerID(), {100, 200});
-  active_layer->Activate(terminal->LayerID());
-  layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
-  __asm__("sti");
+  Terminal *terminal;
+  {
+    LockGuard<Mutex> lock{layer_mutex};
+    terminal = new Terminal;
+    layer_manager->Move(terminal->LayerID(), {100, 200});
+    active_layer->Activate(terminal->LayerID());
+    layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
+  }
+  unsigned long blink_timeout = timer_manager->CurrentTick() + kTimer05Sec;
 
   while (true)
   {
-    __asm__("cli");
-    auto msg = task.ReceiveMessage();
+    // キー入力を待ちつつ、カーソル点滅の時刻になったら起きる
+    auto msg = task.WaitMessage(blink_timeout);
     if (!msg)
     {
-      task.Sleep();
-      __asm__("sti");
+      blink_timeout += kTimer05Sec;
+      // アプリの実行などで何周期も遅れたら、取り戻さずに今から 0.5 秒後にする
+      if (const auto now = timer_manager->CurrentTick(); blink_timeout <= now)
+      {
+        blink_timeout = now + kTimer05Sec;
+      }
+      const auto area = terminal->BlinkCursor();
+      Message msg = MakeLayerMessage(
+          task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
+      task_manager->Call(1, msg, Message::kLayerFinish);
       continue;
     }
-    __asm__("sti");
 
     switch (msg->type)
     {
-    case Message::kTimerTimeout:
-    {
-      const auto area = terminal->BlinkCursor();
-      Message msg = MakeLayerMessage(
-          task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-      __asm__("cli");
-      task_manager->SendMessage(1, msg);
-      __asm__("sti");
-    }
-    break;
     case Message::kKeyPush:
     {
       const auto area = terminal->InputKey(
@@ -721,9 +1158,7 @@ void TaskTerminal(uint64_t task_id, int64_t data)
 
       Message msg = MakeLayerMessage(
           task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-      __asm__("cli");
-      task_manager->SendMessage(1, msg);
-      __asm__("sti");
+      task_manager->Call(1, msg, Message::kLayerFinish);
     }
     break;
     default:
@@ -36,6 +36,11 @@ private:
   void Print(const char *s);
   void ExecuteLine();
   Error ExecuteFile(const fat::DirectoryEntry &file_entry, char *command, char *first_arg);
+  // タスクごとの統計を 1 秒ごとに表示し直す。キーが押されたら戻る
+  void Top();
+
+  // 最後に実行したアプリの終了コード（echo $? で表示する）
+  int last_exit_code_{0};
 
   std::deque<std::array<char, kLineMax>> cmd_history_{};
   int cmd_history_index_{-1};
@@ -4,9 +4,16 @@
 #include "timer.hpp"
 #include "task.hpp"
 #include "interrupt.hpp"
+#include "asmfunc.h"
+#include "msr.hpp"
+#include "smp.hpp"
+#include <algorithm>
+#include <array>
 #include <limits>
 
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
+bool tsc_invariant;
 
 namespace
 {
@@ -15,29 +22,153 @@ namespace
     volatile uint32_t &initial_count = *reinterpret_cast<uint32_t *>(0xfee00380);
     volatile uint32_t &current_count = *reinterpret_cast<uint32_t *>(0xfee00390);
     volatile uint32_t &divide_config = *reinterpret_cast<uint32_t *>(0xfee003e0);
+
+    // PM タイマでの測定は 1 回 10 ミリ秒。ばらつきが許容値に収まるまで回数を増やす
+    const uint64_t kCalibrationPMCount = acpi::kPMTimerFreq / 100;
+    const int kMinCalibrationSamples = 3;
+    const int kMaxCalibrationSamples = 9;
+    const unsigned long kCalibrationTolerancePPM = 1000;
+
+    bool tsc_deadline_mode = false;
+
+    std::array<uint32_t, 4> CallCPUID(uint32_t leaf, uint32_t subleaf = 0)
+    {
+        std::array<uint32_t, 4> regs; // EAX, EBX, ECX, EDX
+        CPUID(leaf, subleaf, regs.data());
+        return regs;
+    }
+
+    /** @brief CPUID から TSC と LAPIC タイマの周波数を求める。分からなければ false */
+    bool CalibrateByCPUID()
+    {
+        // ハイパーバイザの周波数情報 (EAX: TSC kHz, EBX: LAPIC バス kHz)
+        const bool hypervisor = (CallCPUID(1)[2] >> 31) & 1;
+        if (hypervisor && CallCPUID(0x40000000)[0] >= 0x40000010)
+        {
+            const auto freq = CallCPUID(0x40000010);
+            if (freq[0] != 0 && freq[1] != 0)
+            {
+                tsc_freq = freq[0] * 1000ul;
+                lapic_timer_freq = freq[1] * 1000ul;
+                printk("Timer frequency from hypervisor leaf\n");
+                return true;
+            }
+        }
+
+        // ハイパーバイザの下では、LAPIC タイマが 0x15 の水晶の周波数で動くとは限らない。
+        // 周波数を教えてくれないなら PM タイマで測る
+        if (hypervisor)
+        {
+            return false;
+        }
+
+        // TSC / コア水晶クロック比 (EAX: 分母, EBX: 分子, ECX: 水晶の周波数 Hz)
+        const auto max_leaf = CallCPUID(0)[0];
+        if (max_leaf < 0x15)
+        {
+            return false;
+        }
+        const auto ratio = CallCPUID(0x15);
+        if (ratio[0] == 0 || ratio[1] == 0)
+        {
+            return false;
+        }
+        unsigned long crystal_freq = ratio[2];
+        if (crystal_freq == 0 && max_leaf >= 0x16)
+        {
+            // 水晶の周波数が無ければプロセッサのベース周波数 (MHz) から逆算する
+            const unsigned long base_freq = (CallCPUID(0x16)[0] & 0xffffu) * 1000000ul;
+            crystal_freq = base_freq * ratio[0] / ratio[1];
+        }
+        if (crystal_freq == 0)
+        {
+            return false;
+        }
+
+        tsc_freq = crystal_freq * ratio[1] / ratio[0];
+        lapic_timer_freq = crystal_freq; // LAPIC タイマはコア水晶クロックで動く
+        printk("Timer frequency from CPUID 0x15\n");
+        return true;
+    }
+
+    /** @brief PM タイマを基準に TSC と LAPIC タイマの周波数を複数回測り、中央値を採る */
+    void CalibrateByPMTimer()
+    {
+        std::array<unsigned long, kMaxCalibrationSamples> lapic_samples, tsc_samples;
+        int n = 0;
+        unsigned long spread_ppm = 0;
+        while (n < kMaxCalibrationSamples)
+        {
+            const uint64_t pm_start = acpi::PMTimerCount();
+            const uint64_t tsc_start = ReadTSC();
+            StartLAPICTimer();
+            uint64_t pm_end;
+            while ((pm_end = acpi::PMTimerCount()) - pm_start < kCalibrationPMCount);
+            const uint64_t lapic_elapsed = LAPICTimerElapsed();
+            const uint64_t tsc_elapsed = ReadTSC() - tsc_start;
+            StopLAPICTimer();
+
+            const uint64_t pm_elapsed = pm_end - pm_start;
+            lapic_samples[n] = lapic_elapsed * acpi::kPMTimerFreq / pm_elapsed;
+            tsc_samples[n] = tsc_elapsed * acpi::kPMTimerFreq / pm_elapsed;
+            ++n;
+
+            if (n < kMinCalibrationSamples)
+            {
+                continue;
+            }
+            std::sort(lapic_samples.begin(), lapic_samples.begin() + n);
+            std::sort(tsc_samples.begin(), tsc_samples.begin() + n);
+            lapic_timer_freq = lapic_samples[n / 2];
+            tsc_freq = tsc_samples[n / 2];
+            spread_ppm = (lapic_samples[n - 1] - lapic_samples[0]) * 1000000ul / lapic_timer_freq;
+            if (spread_ppm <= kCalibrationTolerancePPM)
+            {
+                break;
+            }
+        }
+        printk("Timer frequency from PM timer: %d samples, spread %lu ppm\n", n, spread_ppm);
+    }
 }
 
 void InitializeLAPICTimer()
 {
-    timer_manager = new TimerManager();
-
     divide_config = 0b1011; // divide 1:1
     lvt_timer = 0b001 << 16; // masked, one-shot
 
-    printk("Start LAPICTimer...\n");
-    StartLAPICTimer();
-    printk("Wait 100 milliseconds...\n");
-    acpi::WaitMilliseconds(1000);
-    printk("Check elapsed time...\n");
-    const auto elapsed = LAPICTimerElapsed();
-    printk("Stop LAPICTimer...\n");
-    StopLAPICTimer();
+    if (!CalibrateByCPUID())
+    {
+        CalibrateByPMTimer();
+    }
 
-    lapic_timer_freq = static_cast<unsigned long>(elapsed) * 1;
+    const auto max_ext_leaf = CallCPUID(0x80000000)[0];
+    tsc_invariant = max_ext_leaf >= 0x80000007 && ((CallCPUID(0x80000007)[3] >> 8) & 1);
+    printk("LAPIC timer: %lu Hz, TSC: %lu Hz (%s)\n", lapic_timer_freq, tsc_freq,
+           tsc_invariant ? "invariant" : "variant");
 
-    divide_config = 0b1011; // divide 1:1
-    lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
-    initial_count = lapic_timer_freq / kTimerFreq;
+    timer_manager = new TimerManager();
+
+    // CPUID.01H:ECX[24] が立っていれば TSC デッドラインモードが使える。
+    // ただし TSC が invariant でなければ期限が ReadTimebase とずれるので使わない
+    tsc_deadline_mode = tsc_invariant && ((CallCPUID(1)[2] >> 24) & 1);
+    printk("LAPIC timer mode: %s\n", tsc_deadline_mode ? "TSC-deadline" : "one-shot");
+    InitializeLocalAPICTimer();
+}
+
+void InitializeLocalAPICTimer()
+{
+    if (tsc_deadline_mode)
+    {
+        lvt_timer = (0b100 << 16) | InterruptVector::kLAPICTimer; // not-masked, TSC-deadline
+        // LVT への書き込みが IA32_TSC_DEADLINE の書き込みより先に効くようにする
+        __asm__("mfence");
+    }
+    else
+    {
+        divide_config = 0b1011; // divide 1:1
+        lvt_timer = (0b000 << 16) | InterruptVector::kLAPICTimer; // not-masked, one-shot
+    }
+    timer_manager->Reprogram();
 }
 
 void StartLAPICTimer()
@@ -55,48 +186,320 @@ void StopLAPICTimer()
     initial_count = 0;
 }
 
-Timer::Timer(unsigned long timeout, int value) : 
-    timeout_{timeout}, value_{value} {}
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id) :
+    timeout_{timeout}, value_{value}, task_id_{task_id} {}
 
-TimerManager::TimerManager()
+TimerManager::TimerManager() :
+    tsc_base_{ReadTimebase()}, tsc_per_tick_{tsc_freq / kTimerFreq}
 {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), -1});
+    for (int i = 0; i < kMaxTimers; ++i) {
+        nodes_[i].next = i + 1 < kMaxTimers ? i + 1 : kNil;
+    }
+    free_head_ = 0;
+
+    for (auto& level_slots : slots_) {
+        level_slots.fill(kNil);
+    }
+    task_timer_timeout_.fill(kNoTimeout);
+    task_timer_tsc_.fill(kNoTimeout);
+    programmed_timeout_.fill(kNoTimeout);
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-    timers_.push(timer);
+WithError<TimerHandle> TimerManager::AddTimer(const Timer& timer) {
+    IRQSaveLockGuard guard{lock_};
+    if (free_head_ == kNil) {
+        // どのノードも指さない添字にしておけば、誤って CancelTimer に渡しても他のタイマを消さない
+        return {{kMaxTimers, 0}, MAKE_ERROR(Error::kFull)};
+    }
+
+    const int32_t index = free_head_;
+    free_head_ = nodes_[index].next;
+    nodes_[index].timer = timer;
+    Link(index);
+
+    if (timer.Timeout() < programmed_timeout_[kTimerCPU]) {
+        if (CurrentCPU() == kTimerCPU) {
+            SetDeadline(kTimerCPU);
+        } else {
+            SendIPI(kTimerCPU, InterruptVector::kReschedule);
+        }
+    }
+    return {{static_cast<uint32_t>(index), nodes_[index].generation}, MAKE_ERROR(Error::kSuccess)};
 }
 
-bool TimerManager::Tick() {
-    ++tick_;
+Error TimerManager::CancelTimer(TimerHandle handle) {
+    IRQSaveLockGuard guard{lock_};
+    if (handle.index >= kMaxTimers) {
+        return MAKE_ERROR(Error::kNoSuchTimer);
+    }
 
-    bool task_timer_timeout = false;
-    while(true) {
-        const auto& t = timers_.top();
-        if (t.Timeout() > tick_) {
-            break;
+    const int32_t index = handle.index;
+    if (nodes_[index].level < 0 || nodes_[index].generation != handle.generation) {
+        // 期限切れか取り消し済み
+        return MAKE_ERROR(Error::kNoSuchTimer);
+    }
+
+    Unlink(index);
+    FreeNode(index);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void TimerManager::FreeNode(int32_t index) {
+    auto& node = nodes_[index];
+    node.level = -1;
+    ++node.generation;
+    node.next = free_head_;
+    free_head_ = index;
+}
+
+void TimerManager::Link(int32_t index) {
+    const unsigned long kMaxDelta = (1ul << (kWheelBits * kWheelLevels)) - 1;
+
+    auto& node = nodes_[index];
+    // 過ぎてしまった期限は次に処理する tick のスロットに入れる
+    unsigned long timeout = std::max(node.timer.Timeout(), wheel_current_);
+    const unsigned long delta = timeout - wheel_current_;
+
+    int level = 0;
+    while (level < kWheelLevels - 1 && delta >> (kWheelBits * (level + 1)) != 0) {
+        ++level;
+    }
+    if (delta > kMaxDelta) {
+        // 最上段に収まらないタイマは最上段の一番遠いスロットに置き、振り分け直すたびに近づける
+        timeout = wheel_current_ + kMaxDelta;
+    }
+    const int slot = (timeout >> (kWheelBits * level)) & (kWheelSize - 1);
+
+    node.level = level;
+    node.slot = slot;
+    node.prev = kNil;
+    node.next = slots_[level][slot];
+    if (node.next != kNil) {
+        nodes_[node.next].prev = index;
+    }
+    slots_[level][slot] = index;
+    slot_bitmap_[level] |= 1ul << slot;
+}
+
+void TimerManager::Unlink(int32_t index) {
+    auto& node = nodes_[index];
+    if (node.prev != kNil) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        slots_[node.level][node.slot] = node.next;
+    }
+    if (node.next != kNil) {
+        nodes_[node.next].prev = node.prev;
+    }
+
+    if (slots_[node.level][node.slot] == kNil) {
+        slot_bitmap_[node.level] &= ~(1ul << node.slot);
+    }
+}
+
+void TimerManager::Cascade(int level) {
+    if (level >= kWheelLevels) {
+        return;
+    }
+
+    const int index = (wheel_current_ >> (kWheelBits * level)) & (kWheelSize - 1);
+    if (index == 0) {
+        Cascade(level + 1);
+    }
+
+    int32_t i = slots_[level][index];
+    slots_[level][index] = kNil;
+    slot_bitmap_[level] &= ~(1ul << index);
+    while (i != kNil) {
+        const int32_t next = nodes_[i].next;
+        Link(i);
+        i = next;
+    }
+}
+
+void TimerManager::RunTimers(unsigned long tick) {
+    while (wheel_current_ <= tick) {
+        const int index = wheel_current_ & (kWheelSize - 1);
+        if (index == 0) {
+            Cascade(1);
+        }
+
+        while (slots_[0][index] != kNil) {
+            const int32_t i = slots_[0][index];
+            const Timer t = nodes_[i].timer;
+            Unlink(i);
+            FreeNode(i);
+
+            // 通知先が TimerManager を呼べるようにロックを外す。
+            // その間に追加された期限切れのタイマもこのスロットに入るので、続けて処理される
+            lock_.Unlock();
+            if (t.Value() == kWakeupTimerValue) {
+                task_manager->Wakeup(t.TaskID());
+            } else {
+                Message m{Message::kTimerTimeout};
+                m.arg.timer.timeout = t.Timeout();
+                m.arg.timer.value = t.Value();
+                task_manager->SendMessage(t.TaskID(), m);
+            }
+            lock_.Lock();
+        }
+
+        // 段 0 の空きスロットは一周するところまで飛ばしてよい（振り分け直しは一周ごと）
+        unsigned long next = wheel_current_ - index + kWheelSize;
+        if (index + 1 < kWheelSize) {
+            if (const uint64_t rest = slot_bitmap_[0] >> (index + 1); rest != 0) {
+                next = wheel_current_ + 1 + __builtin_ctzll(rest);
+            }
         }
+        wheel_current_ = std::min(next, tick + 1);
+    }
+}
 
-        if (t.Value() == kTaskTimerValue) {
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue});
+unsigned long TimerManager::NextTimeout() const {
+    unsigned long timeout = kNoTimeout;
+    for (int level = 0; level < kWheelLevels; ++level) {
+        const uint64_t bitmap = slot_bitmap_[level];
+        if (bitmap == 0) {
             continue;
         }
 
-        Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        task_manager->SendMessage(1, m);
+        const int shift = kWheelBits * level;
+        const unsigned long block = wheel_current_ >> shift;
+        const int index = block & (kWheelSize - 1);
+        // 現在のスロットを振り分け直し済みなら、そこにあるのは次の周のタイマ
+        const bool cascaded = (wheel_current_ & ((1ul << shift) - 1)) != 0;
+        const int start = (index + cascaded) & (kWheelSize - 1);
+        const uint64_t rotated =
+            start == 0 ? bitmap : (bitmap >> start) | (bitmap << (kWheelSize - start));
+        const int slot = (start + __builtin_ctzll(rotated)) & (kWheelSize - 1);
 
-        timers_.pop();
+        unsigned long t = (block - index + slot) << shift;
+        if (t < wheel_current_) {
+            t += static_cast<unsigned long>(kWheelSize) << shift;
+        }
+        timeout = std::min(timeout, t);
     }
+    return timeout;
+}
+
+void TimerManager::UpdateTick() {
+    tick_ = CurrentTick();
+}
+
+uint64_t TimerManager::TSCAt(unsigned long tick) const {
+    return tsc_base_ + tick * tsc_per_tick_;
+}
+
+unsigned long TimerManager::CurrentTick() const {
+    // tsc_base_ と tsc_per_tick_ は変わらないのでロックは要らない
+    return (ReadTimebase() - tsc_base_) / tsc_per_tick_;
+}
+
+bool TimerManager::Tick() {
+    const int cpu = CurrentCPU();
+    LockGuard<SpinLock> guard{lock_};
+    UpdateTick();
+    programmed_timeout_[cpu] = kNoTimeout;
 
+    bool task_timer_timeout = false;
+    if (task_timer_timeout_[cpu] <= tick_ || task_timer_tsc_[cpu] <= ReadTimebase()) {
+        task_timer_timeout = true;
+        task_timer_timeout_[cpu] = kNoTimeout;
+        task_timer_tsc_[cpu] = kNoTimeout;
+        // ロックの順序は timer_manager -> task_manager（逆向きには取らない）
+        if (task_manager->NumRunnable() > 1) {
+            task_timer_timeout_[cpu] = tick_ + kTaskTimerPeriod;
+        }
+    }
+
+    if (cpu == kTimerCPU) {
+        RunTimers(tick_);
+    }
+
+    SetDeadline(cpu);
     return task_timer_timeout;
 }
 
+void TimerManager::ArmTaskTimer() {
+    IRQSaveLockGuard guard{lock_};
+    const int cpu = CurrentCPU();
+    if (task_timer_timeout_[cpu] != kNoTimeout) {
+        return;
+    }
+
+    task_timer_timeout_[cpu] = CurrentTick() + kTaskTimerPeriod;
+    if (task_timer_timeout_[cpu] < programmed_timeout_[cpu]) {
+        SetDeadline(cpu);
+    }
+}
+
+void TimerManager::ArmTaskTimer(unsigned long timeout) {
+    IRQSaveLockGuard guard{lock_};
+    const int cpu = CurrentCPU();
+    if (timeout >= task_timer_timeout_[cpu]) {
+        return;
+    }
+
+    task_timer_timeout_[cpu] = timeout;
+    if (timeout < programmed_timeout_[cpu]) {
+        SetDeadline(cpu);
+    }
+}
+
+void TimerManager::ArmTaskTimerTSC(uint64_t tsc_deadline) {
+    IRQSaveLockGuard guard{lock_};
+    const int cpu = CurrentCPU();
+    if (tsc_deadline >= task_timer_tsc_[cpu]) {
+        return;
+    }
+
+    task_timer_tsc_[cpu] = tsc_deadline;
+    SetDeadline(cpu);
+}
+
+void TimerManager::Reprogram() {
+    IRQSaveLockGuard guard{lock_};
+    SetDeadline(CurrentCPU());
+}
+
+void TimerManager::SetDeadline(int cpu) {
+    UpdateTick();
+    const unsigned long max_ticks = tsc_deadline_mode ? kMaxDeadlineTicks : kMaxOneShotTicks;
+    const unsigned long timeout = std::min({
+        cpu == kTimerCPU ? NextTimeout() : kNoTimeout,
+        task_timer_timeout_[cpu], tick_ + max_ticks});
+    programmed_timeout_[cpu] = timeout;
+    const uint64_t deadline = std::min(TSCAt(timeout), task_timer_tsc_[cpu]);
+
+    if (tsc_deadline_mode) {
+        // 過去の値を書いた場合はすぐに割り込みが発生する
+        WriteMSR(kIA32_TSC_DEADLINE, deadline);
+        return;
+    }
+
+    // 期限までの残り時間を LAPIC タイマのカウントに換算する。
+    // 早めに発火してしまっても Tick() で期限前と判定され、残りの時間で設定し直される。
+    const uint64_t now = ReadTimebase();
+    uint64_t count = 1;
+    if (deadline > now) {
+        count = (deadline - now) * lapic_timer_freq / tsc_freq;
+    }
+    initial_count = std::clamp<uint64_t>(count, 1, kCountMax);
+}
+
 TimerManager* timer_manager;
 
+uint64_t ReadTimebase()
+{
+    if (tsc_invariant)
+    {
+        return ReadTSC();
+    }
+    // ワンショットモードの割り込みは 1 秒以内に来るので、PM タイマが一周する前に読まれる
+    const uint64_t count = acpi::PMTimerCount();
+    return static_cast<uint64_t>(static_cast<unsigned __int128>(count) * tsc_freq / acpi::kPMTimerFreq);
+}
+
 extern "C" void LAPICTimerOnInterrupt(const TaskContext &ctx_stack)
 {
     const bool task_timer_timeout = timer_manager->Tick();
@@ -104,6 +507,12 @@ extern "C" void LAPICTimerOnInterrupt(const TaskContext &ctx_stack)
 
     if (task_timer_timeout)
     {
+        // 予算を使い切ったリアルタイムタスクは締め切りの時刻に起こす
+        if (auto [task_id, deadline] = task_manager->ThrottleRealTime(); task_id != 0)
+        {
+            timer_manager->AddTimer(Timer{deadline, kWakeupTimerValue, task_id});
+        }
+        task_manager->Rebalance();
         task_manager->SwitchTask(ctx_stack);
     }
 }
@@ -1,50 +1,160 @@
 #pragma once
 
+#include <array>
 #include <cstdint>
-#include <deque>
-#include <queue>
+#include <limits>
 #include <interrupt.hpp>
+#include "error.hpp"
+#include "lock.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 void InitializeLAPICTimer();
+/** @brief この CPU の LAPIC タイマを割り込みが来るよう設定する。AP は起動時に自分で呼ぶ */
+void InitializeLocalAPICTimer();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
 
+const int kTimerFreq = 1000;
+
+const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
+const int kTimer05Sec = static_cast<int>(kTimerFreq * 0.5);
+// 値がこれのタイマはメッセージを送らず、タスクを起こすだけ（Task::WaitMessage 用）
+const int kWakeupTimerValue = std::numeric_limits<int>::min();
+
+// LAPIC タイマに設定する期限の上限（tick）。ワンショットモードでは 32 ビットの
+// カウンタに収まるよう短くする。期限が無くても最長この間隔で一度割り込む
+const int kMaxOneShotTicks = kTimerFreq;
+const int kMaxDeadlineTicks = kTimerFreq * 3600;
+
+/** @brief タイマ。タイムアウトすると task_id のタスクへ kTimerTimeout を送る */
 class Timer
 {
 public:
-  Timer(unsigned long timeout, int value);
+  Timer(unsigned long timeout, int value, uint64_t task_id = 1);
   unsigned long Timeout() const { return timeout_; }
   int Value() const { return value_; }
+  uint64_t TaskID() const { return task_id_; }
 
 private:
   unsigned long timeout_;
   int value_;
+  uint64_t task_id_;
 };
 
-/** @brief タイマ優先度を比較する。タイムアウトが近いほど高い */
-inline bool operator<(const Timer &lhs, const Timer &rhs)
+/** @brief AddTimer が返すタイマの識別子。CancelTimer に渡して取り消す。
+ *
+ * ノードは再利用されるので、世代番号で取り消し済み・期限切れのハンドルを見分ける。
+ */
+struct TimerHandle
 {
-  return lhs.Timeout() > rhs.Timeout();
-}
+  uint32_t index;
+  uint32_t generation;
+};
 
+/** @brief タイマを管理する。
+ *
+ * タイマは階層型タイミングホイール（64 スロット x 4 段）で保持する。
+ * 段 L のスロットには期限まで 64^L 以上 64^(L+1) 未満の tick のタイマを入れ、
+ * 下の段が一周するたびに上の段のスロットを下の段へ振り分け直す。
+ * 追加・取り消し・期限切れはいずれも O(1) で、ノードは事前に確保したものを使う。
+ *
+ * LAPIC タイマは TSC デッドラインモード（使えなければワンショットモード）で、
+ * 次の期限（タイマのタイムアウトかタスク切り替えの時刻の早い方）に合わせて毎回設定し直す。
+ * タイマの期限は tick 単位だが、タスク切り替えの期限は ArmTaskTimerTSC で TSC 単位でも指定できる。
+ * 割り込みの間隔は一定ではないので、tick_ は TSC から追いつかせる。
+ * タスク切り替えが不要（実行可能なタスクが 1 つ以下）なら切り替え用の期限は設定しない。
+ *
+ * LAPIC タイマは CPU ごとにあるので、タスク切り替えの期限は CPU ごとに持つ。
+ * ホイールのタイマは kTimerCPU だけが処理し、他の CPU はタスク切り替えの期限だけで割り込む。
+ * 他の CPU の LAPIC タイマは設定できないので、その期限を早めるときは IPI で頼む。
+ * TSC は全 CPU で揃っている前提。
+ * TSC が invariant でなければ、時刻は ReadTimebase で PM タイマから取り、
+ * TSC デッドラインモードは使わずにワンショットモードで動かす。
+ *
+ * 状態は lock_ で保護する。期限切れのタイマの通知はロックを外して行う。
+ * ロックを入れ子にするのは timer_manager -> task_manager の順だけで、
+ * TaskManager は自分のロックを外してから TimerManager を呼ぶ。
+ */
 class TimerManager
 {
 public:
+  static const int kMaxTimers = 4096;
+  static const int kTimerCPU = 0;
+
   TimerManager();
-  void AddTimer(const Timer &timer);
+  WithError<TimerHandle> AddTimer(const Timer &timer);
+  Error CancelTimer(TimerHandle handle);
+  /** @brief タイマ割り込みの処理。割り込み禁止で呼ぶ。タスクを切り替えるべきなら true */
   bool Tick();
-  unsigned long CurrentTick() const { return tick_; }
+  unsigned long CurrentTick() const;
+
+  /** @brief この CPU のタスク切り替えの期限が未設定なら設定する。実行可能なタスクが増えたときに呼ぶ */
+  void ArmTaskTimer();
+  /** @brief この CPU のタスク切り替えの期限を timeout (tick) まで早める（遅くはしない） */
+  void ArmTaskTimer(unsigned long timeout);
+  /** @brief この CPU のタスク切り替えの期限を ReadTimebase の値 tsc_deadline まで早める。tick より細かく指定できる */
+  void ArmTaskTimerTSC(uint64_t tsc_deadline);
+  uint64_t TSCPerTick() const { return tsc_per_tick_; }
+  /** @brief tick に対応する ReadTimebase の値 */
+  uint64_t TSCAt(unsigned long tick) const;
+  /** @brief 次の期限に合わせてこの CPU の LAPIC タイマを設定し直す */
+  void Reprogram();
 
 private:
-  volatile unsigned long tick_{0};
-  std::priority_queue<Timer> timers_{};
+  static const unsigned long kNoTimeout = std::numeric_limits<unsigned long>::max();
+  static const int kWheelBits = 6;
+  static const int kWheelSize = 1 << kWheelBits;
+  static const int kWheelLevels = 4;
+  static const int32_t kNil = -1;
+
+  struct Node
+  {
+    Timer timer{0, 0};
+    uint32_t generation{0};
+    int32_t prev{kNil}, next{kNil};
+    int8_t level{-1}; // -1: 未使用
+    uint8_t slot{0};
+  };
+
+  SpinLock lock_{"timer_manager"};
+  unsigned long tick_{0};
+  // tick 0 に対応する ReadTimebase の値と、1 tick あたりのそのカウント
+  uint64_t tsc_base_;
+  uint64_t tsc_per_tick_;
+  std::array<unsigned long, kMaxCPUs> task_timer_timeout_;
+  // tick より細かいタスク切り替えの期限 (TSC)。リアルタイムタスクの予算切れに使う
+  std::array<uint64_t, kMaxCPUs> task_timer_tsc_;
+  std::array<unsigned long, kMaxCPUs> programmed_timeout_;
+
+  // wheel_current_ は次に処理する tick
+  unsigned long wheel_current_{0};
+  std::array<Node, kMaxTimers> nodes_{};
+  int32_t free_head_{kNil};
+  std::array<std::array<int32_t, kWheelSize>, kWheelLevels> slots_{};
+  std::array<uint64_t, kWheelLevels> slot_bitmap_{};
+
+  // 以下は lock_ を取った状態で呼ぶ
+  void UpdateTick();
+  void FreeNode(int32_t index);
+  void Link(int32_t index);
+  void Unlink(int32_t index);
+  void Cascade(int level);
+  void RunTimers(unsigned long tick);
+  unsigned long NextTimeout() const;
+  void SetDeadline(int cpu);
 };
 
 extern TimerManager *timer_manager;
-extern unsigned long lapic_timer_freq;
-const int kTimerFreq = 100;
 
-const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::min();
\ No newline at end of file
+/** @brief タイマとスケジューラが時刻に使う単調カウンタ（tsc_freq Hz）。
+ *
+ * TSC が invariant なら TSC そのもの。そうでなければ TSC は P-state や停止で進み方が変わるので、
+ * PM タイマのカウントを TSC の単位に換算した値を返す（NowNs と同じ元になる）。
+ */
+uint64_t ReadTimebase();
+extern unsigned long lapic_timer_freq;
+// TSC の周波数 (Hz) と、それが電力状態や周波数変更に関わらず一定 (invariant) か
+extern unsigned long tsc_freq;
+extern bool tsc_invariant;
@@ -48,14 +48,31 @@ void DrawWindow(PixelWriter &writer, const char *title)
     DrawWindowTitle(writer, title, false);
 }
 
-Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height}
+void OpaqueRuns::Build(const uint8_t *image, size_t bytes_per_line, Vector2D<int> size,
+                       PixelFormat format, PixelColor transparent_color)
 {
-    data_.resize(height);
-    for (int y = 0; y < height; ++y)
-    {
-        data_[y].resize(width);
-    }
+    VisitPixelFormat(format, [&](auto traits) {
+        using Traits = decltype(traits);
+        constexpr int kBytes = Traits::kBytesPerPixel;
+        const uint32_t tc = Traits::Pack(transparent_color);
+        BuildIf(size, [&](int x, int y) {
+            return LoadPixel<kBytes>(image + bytes_per_line * y + kBytes * x) != tc;
+        });
+    });
+}
 
+void OpaqueRuns::Blit(uint8_t *dst, size_t dst_bytes_per_line, const uint8_t *image, size_t bytes_per_line,
+                      int bytes_per_pixel, const Rectangle<int> &area) const
+{
+    ForEach(area, [&](int y, int start, int end) {
+        CopySpan(dst + dst_bytes_per_line * (y - area.pos.y) + bytes_per_pixel * (start - area.pos.x),
+                 image + bytes_per_line * y + bytes_per_pixel * start,
+                 static_cast<size_t>(bytes_per_pixel) * (end - start));
+    });
+}
+
+Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height}
+{
     FrameBufferConfig config{};
     config.frame_buffer = nullptr;
     config.horizontal_resolution = width;
@@ -68,9 +85,16 @@ Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}
     }
 }
 
-void Window::DrawTo(FrameBuffer &dst, Vector2D<int> position, const Rectangle<int> &area)
+void Window::DrawTo(FrameBuffer &dst, Vector2D<int> position, const Rectangle<int> &area, uint8_t alpha)
 {
-    if (!transparent_color_)
+    if (alpha == 0)
+    {
+        return;
+    }
+    const auto dst_config = dst.Config();
+    const auto shadow_config = shadow_buffer_.Config();
+    const auto format = shadow_config.pixel_format;
+    if (IsOpaque() && alpha == 255 && dst_config.pixel_format == format)
     {
         Rectangle<int> window_area{position, Size()};
         Rectangle<int> intersection = area & window_area;
@@ -78,24 +102,153 @@ void Window::DrawTo(FrameBuffer &dst, Vector2D<int> position, const Rectangle<in
         return;
     }
 
-    const auto tc = transparent_color_.value();
+    // 画面の形式の画素を、不透明度に応じて書き込み先の画素と混ぜるか、そのまま写す
+    const auto draw_area = ClipRect(area.pos, area.size, dst_config.horizontal_resolution,
+                                    dst_config.vertical_resolution) &
+                           Rectangle<int>{position, Size()};
+    if (draw_area.size.x <= 0 || draw_area.size.y <= 0)
+    {
+        return;
+    }
+    const Rectangle<int> src_area{draw_area.pos - position, draw_area.size};
+    if (dst_config.pixel_format != format)
+    {
+        DrawToGeneric(dst, position, src_area, alpha);
+        return;
+    }
+    const int bytes_per_pixel = BytesPerPixel(format);
+    const size_t bytes_per_line = static_cast<size_t>(bytes_per_pixel) * shadow_config.pixels_per_scan_line;
+    const size_t dst_bytes_per_line = static_cast<size_t>(bytes_per_pixel) * dst_config.pixels_per_scan_line;
+    // ウィンドウ内の (x, y) の画素の書き込み先
+    auto dst_at = [&](int x, int y) {
+        return dst_config.frame_buffer + dst_bytes_per_line * (position.y + y) + bytes_per_pixel * (position.x + x);
+    };
+
+    if (!alpha_.empty())
+    {
+        for (int y = src_area.pos.y; y < src_area.pos.y + src_area.size.y; ++y)
+        {
+            BlendSpan(dst_at(src_area.pos.x, y), RowAt(y) + bytes_per_pixel * src_area.pos.x,
+                      &alpha_[static_cast<size_t>(width_) * y + src_area.pos.x], alpha, src_area.size.x, format);
+        }
+        return;
+    }
+    if (!transparent_color_)
+    {
+        for (int y = src_area.pos.y; y < src_area.pos.y + src_area.size.y; ++y)
+        {
+            BlendSpan(dst_at(src_area.pos.x, y), RowAt(y) + bytes_per_pixel * src_area.pos.x,
+                      nullptr, alpha, src_area.size.x, format);
+        }
+        return;
+    }
+
+    // 透過色を持つときは、透過色でない区間だけを描く
+    if (opaque_runs_dirty_)
+    {
+        opaque_runs_.Build(shadow_config.frame_buffer, bytes_per_line, Size(), format, transparent_color_.value());
+        opaque_runs_dirty_ = false;
+    }
+    if (alpha == 255)
+    {
+        opaque_runs_.Blit(dst_at(src_area.pos.x, src_area.pos.y), dst_bytes_per_line,
+                          shadow_config.frame_buffer, bytes_per_line, bytes_per_pixel, src_area);
+        return;
+    }
+    opaque_runs_.ForEach(src_area, [&](int y, int start, int end) {
+        BlendSpan(dst_at(start, y), RowAt(y) + bytes_per_pixel * start, nullptr, alpha, end - start, format);
+    });
+}
+
+void Window::DrawToGeneric(FrameBuffer &dst, Vector2D<int> position, const Rectangle<int> &src_area, uint8_t alpha)
+{
+    // 書き込み先の形式が違うときは、画素ごとに色へ戻して書く。遅いが、どの形式の組み合わせでも描ける
+    const auto dst_config = dst.Config();
+    const int dst_bytes_per_pixel = BytesPerPixel(dst_config.pixel_format);
     auto &writer = dst.Writer();
-    for (int y = std::max(0, 0 - position.y); y < std::min(Height(), writer.Height() - position.y); ++y)
+    // 透過色は OpaqueRuns::Build と同じく、ウィンドウの形式の値どうしで比べる
+    const auto format = shadow_buffer_.Config().pixel_format;
+    const int bytes_per_pixel = BytesPerPixel(format);
+    const std::optional<uint32_t> key =
+        transparent_color_ ? std::optional<uint32_t>{PackPixel(format, transparent_color_.value())} : std::nullopt;
+    for (int y = src_area.pos.y; y < src_area.pos.y + src_area.size.y; ++y)
     {
-        for (int x = std::max(0, 0 - position.x); x < std::min(Width(), writer.Width() - position.x); ++x)
+        for (int x = src_area.pos.x; x < src_area.pos.x + src_area.size.x; ++x)
         {
-            const auto c = At(x, y);
-            if (c != tc)
+            const uint8_t *sp = RowAt(y) + bytes_per_pixel * x;
+            const uint32_t value = VisitPixelFormat(format, [sp](auto traits) {
+                return LoadPixel<decltype(traits)::kBytesPerPixel>(sp);
+            });
+            if (key && value == key.value())
+            {
+                continue;
+            }
+            const PixelColor c = UnpackPixel(format, value);
+            uint32_t a = alpha;
+            if (!alpha_.empty())
+            {
+                a = (a * alpha_[static_cast<size_t>(width_) * y + x] + 127) / 255;
+            }
+            if (a == 0)
             {
-                writer.Write({position.x + x, position.y + y}, c);
+                continue;
             }
+
+            const Vector2D<int> pos{position.x + x, position.y + y};
+            if (a == 255)
+            {
+                writer.Write(pos, c);
+                continue;
+            }
+            const uint8_t *p = dst_config.frame_buffer +
+                               static_cast<size_t>(dst_bytes_per_pixel) * (dst_config.pixels_per_scan_line * pos.y + pos.x);
+            const PixelColor d = VisitPixelFormat(dst_config.pixel_format, [p](auto traits) {
+                using Traits = decltype(traits);
+                return Traits::Unpack(LoadPixel<Traits::kBytesPerPixel>(p));
+            });
+            auto mix = [a](uint8_t sc, uint8_t dc) {
+                return static_cast<uint8_t>((sc * a + dc * (255 - a) + 127) / 255);
+            };
+            writer.Write(pos, {mix(c.r, d.r), mix(c.g, d.g), mix(c.b, d.b)});
         }
     }
 }
 
 void Window::SetTransparentColor(std::optional<PixelColor> c)
 {
+    const auto format = shadow_buffer_.Config().pixel_format;
+    if (c && UnpackPixel(format, PackPixel(format, *c)) != *c)
+    {
+        // RGB565 などでは、近い色も同じ値になって透過してしまう
+        Log(kWarn, "transparent color (%d, %d, %d) is not exact in pixel format %d\n",
+            c->r, c->g, c->b, format);
+    }
     transparent_color_ = c;
+    opaque_runs_dirty_ = true;
+}
+
+void Window::EnableAlpha(uint8_t alpha)
+{
+    alpha_.assign(static_cast<size_t>(width_) * height_, alpha);
+}
+
+void Window::FillAlpha(Vector2D<int> pos, Vector2D<int> size, uint8_t alpha)
+{
+    if (alpha_.empty())
+    {
+        return;
+    }
+    const auto area = ClipRect(pos, size, width_, height_);
+    for (int y = area.pos.y; y < area.pos.y + area.size.y; ++y)
+    {
+        auto row = alpha_.begin() + static_cast<size_t>(width_) * y;
+        std::fill(row + area.pos.x, row + area.pos.x + area.size.x, alpha);
+    }
+}
+
+bool Window::IsOpaque() const
+{
+    return !transparent_color_ && alpha_.empty();
 }
 
 Window::WindowWriter *Window::Writer()
@@ -103,25 +256,45 @@ Window::WindowWriter *Window::Writer()
     return &writer_;
 }
 
-PixelColor &Window::At(int x, int y)
+PixelColor Window::At(int x, int y) const
 {
-    return data_[y][x];
+    const auto format = shadow_buffer_.Config().pixel_format;
+    const uint8_t *p = RowAt(y) + BytesPerPixel(format) * x;
+    return VisitPixelFormat(format, [p](auto traits) {
+        using Traits = decltype(traits);
+        return Traits::Unpack(LoadPixel<Traits::kBytesPerPixel>(p));
+    });
 }
 
-const PixelColor &Window::At(int x, int y) const
+const uint8_t *Window::RowAt(int y) const
 {
-    return data_[y][x];
+    const auto config = shadow_buffer_.Config();
+    return config.frame_buffer +
+           static_cast<size_t>(BytesPerPixel(config.pixel_format)) * config.pixels_per_scan_line * y;
 }
 
 void Window::Write(Vector2D<int> pos, PixelColor c)
 {
-    data_[pos.y][pos.x] = c;
     shadow_buffer_.Writer().Write({pos.x, pos.y}, c);
+    opaque_runs_dirty_ = true;
+}
+
+void Window::FillRect(Vector2D<int> pos, Vector2D<int> size, PixelColor c)
+{
+    shadow_buffer_.Writer().FillRect(pos, size, c);
+    opaque_runs_dirty_ = true;
+}
+
+void Window::WriteGlyph(Vector2D<int> pos, const uint8_t *glyph, PixelColor c)
+{
+    shadow_buffer_.Writer().WriteGlyph(pos, glyph, c);
+    opaque_runs_dirty_ = true;
 }
 
 void Window::Move(Vector2D<int> dst_pos, const Rectangle<int> &src)
 {
     shadow_buffer_.Move(dst_pos, src);
+    opaque_runs_dirty_ = true;
 }
 
 Vector2D<int> Window::Size() const
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <optional>
 #include <string>
@@ -8,6 +9,80 @@
 
 void DrawWindow(PixelWriter &writer, const char *title);
 
+/** @brief 透過色を持つ画像の各行で、透過色でない画素が続く区間 (run) の一覧 */
+class OpaqueRuns
+{
+public:
+    struct Run
+    {
+        int x, length;
+    };
+
+    /** @brief format の画素が 1 行 bytes_per_line バイトで並んだ image から作り直す。
+     *
+     * format にしてから比べるので、format で transparent_color と区別できない色も透過する。
+     */
+    void Build(const uint8_t *image, size_t bytes_per_line, Vector2D<int> size,
+               PixelFormat format, PixelColor transparent_color);
+    /** @brief is_opaque(x, y) が真になる画素を区間にまとめて作り直す */
+    template <class Pred>
+    void BuildIf(Vector2D<int> size, Pred is_opaque)
+    {
+        runs_.clear();
+        row_start_.assign(1, 0);
+        for (int y = 0; y < size.y; ++y)
+        {
+            int x = 0;
+            while (x < size.x)
+            {
+                while (x < size.x && !is_opaque(x, y))
+                {
+                    ++x;
+                }
+                const int start = x;
+                while (x < size.x && is_opaque(x, y))
+                {
+                    ++x;
+                }
+                if (start < x)
+                {
+                    runs_.push_back({start, x - start});
+                }
+            }
+            row_start_.push_back(runs_.size());
+        }
+    }
+    /** @brief image の area（image の座標）にある区間の画素だけを、dst から始まる領域へ写す。
+     *
+     * dst は area.pos の画素の写し先を指し、dst_bytes_per_line バイトごとに次の行になる。
+     */
+    void Blit(uint8_t *dst, size_t dst_bytes_per_line, const uint8_t *image, size_t bytes_per_line,
+              int bytes_per_pixel, const Rectangle<int> &area) const;
+    /** @brief area（image の座標）と重なる区間ごとに、その行 y と区間 [x_start, x_end) で f を呼ぶ */
+    template <class Func>
+    void ForEach(const Rectangle<int> &area, Func f) const
+    {
+        const int x_end = area.pos.x + area.size.x;
+        for (int y = area.pos.y; y < area.pos.y + area.size.y; ++y)
+        {
+            for (size_t i = row_start_[y]; i < row_start_[y + 1] && runs_[i].x < x_end; ++i)
+            {
+                const int start = std::max(runs_[i].x, area.pos.x);
+                const int end = std::min(runs_[i].x + runs_[i].length, x_end);
+                if (start < end)
+                {
+                    f(y, start, end);
+                }
+            }
+        }
+    }
+    size_t NumRuns() const { return runs_.size(); }
+
+private:
+    std::vector<Run> runs_{};
+    std::vector<size_t> row_start_{}; // y 行目の区間は runs_[row_start_[y]] から runs_[row_start_[y + 1]] の手前まで
+};
+
 class Window
 {
 public:
@@ -19,6 +94,14 @@ public:
         {
             window_.Write(pos, c);
         }
+        virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor &c) override
+        {
+            window_.FillRect(pos, size, c);
+        }
+        virtual void WriteGlyph(Vector2D<int> pos, const uint8_t *glyph, const PixelColor &c) override
+        {
+            window_.WriteGlyph(pos, glyph, c);
+        }
 
         // virtual Vector2D<int> Size() const override { return {window_.Width(), window_.Height()}; }
         virtual int Width() const override { return window_.Width(); }
@@ -36,14 +119,24 @@ public:
     virtual void Activate() {}
     virtual void Deactivate() {}
 
-    void DrawTo(FrameBuffer &screen, Vector2D<int> position, const Rectangle<int> &area);
+    /** @brief ウィンドウのうち画面上の area と重なる部分を描く。alpha はウィンドウ全体の不透明度 */
+    void DrawTo(FrameBuffer &screen, Vector2D<int> position, const Rectangle<int> &area, uint8_t alpha = 255);
+    /** @brief c の画素を描かないようにする。画面の形式で c と区別できない色も描かれなくなる */
     void SetTransparentColor(std::optional<PixelColor> c);
+    /** @brief 画素ごとの不透明度 (0: 透明 ～ 255: 不透明) を持たせ、全て alpha にする。持たせると透過色は使わない */
+    void EnableAlpha(uint8_t alpha = 255);
+    /** @brief 矩形の画素の不透明度を alpha にする。EnableAlpha していなければ何もしない */
+    void FillAlpha(Vector2D<int> pos, Vector2D<int> size, uint8_t alpha);
+    /** @brief 全ての画素が下を完全に隠すか。隠すウィンドウの下は合成時に描かない */
+    bool IsOpaque() const;
     WindowWriter *Writer();
 
     void Write(Vector2D<int> pos, PixelColor c);
-    PixelColor &At(int x, int y);
+    /** @brief 矩形を塗りつぶす。ウィンドウの外にはみ出した部分は書かない */
+    void FillRect(Vector2D<int> pos, Vector2D<int> size, PixelColor c);
+    void WriteGlyph(Vector2D<int> pos, const uint8_t *glyph, PixelColor c);
     void Move(Vector2D<int> dst_pos, const Rectangle<int> &src);
-    const PixelColor &At(int x, int y) const;
+    PixelColor At(int x, int y) const;
 
     Vector2D<int> Size() const;
     int Width() const;
@@ -51,11 +144,18 @@ public:
 
 private:
     int width_, height_;
-    std::vector<std::vector<PixelColor>> data_{};
     WindowWriter writer_{*this};
     std::optional<PixelColor> transparent_color_{std::nullopt};
+    // 透過色を持つときに描く区間。画素を書き換えたら次に描くときに作り直す
+    OpaqueRuns opaque_runs_{};
+    bool opaque_runs_dirty_{true};
+    // 画素ごとの不透明度。空なら全て不透明。画面の形式には不透明度を入れる場所が無いこともあるので別に持つ
+    std::vector<uint8_t> alpha_{};
 
+    // ウィンドウの画素はここにだけ持つ。形式は画面と同じなので、そのまま画面へコピーできる
     FrameBuffer shadow_buffer_{};
+    const uint8_t *RowAt(int y) const;
+    void DrawToGeneric(FrameBuffer &dst, Vector2D<int> position, const Rectangle<int> &src_area, uint8_t alpha);
 };
 
 class ToplevelWindow : public Window
@@ -74,6 +174,16 @@ class ToplevelWindow : public Window
                 {
                     window_.Write(pos + kTopLeftMargin, c);
                 }
+                virtual void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor& c) override
+                {
+                    // 枠にはみ出さないよう内側で切り詰めてから渡す
+                    const auto area = ClipRect(pos, size, Width(), Height());
+                    window_.FillRect(area.pos + kTopLeftMargin, area.size, c);
+                }
+                virtual void WriteGlyph(Vector2D<int> pos, const uint8_t* glyph, const PixelColor& c) override
+                {
+                    window_.WriteGlyph(pos + kTopLeftMargin, glyph, c);
+                }
                 virtual int Width() const override
                 {
                     return window_.Width() - kTopLeftMargin.x - kBottomRightMargin.x;